@@ -19,406 +19,6868 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <wiringPi.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <math.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <malloc.h>
+#include <linux/gpio.h>
 #include <curl/curl.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-// what GPIO input pin are we using? (wiringPi pin number)
+// what GPIO input pin are we using, if no channels are given on the command line? (wiringPi pin number)
 #define	PIN_INPUT 0
 
+// the same input, as a line offset on the GPIO character device (BCM GPIO number)
+#define PIN_INPUT_LINE 17
+
+// maximum number of GPIO inputs one process can count
+#define CHANNEL_MAX 8
+
+// maximum number of edge events taken from the GPIO character device per read()
+#define GPIO_EVENT_BATCH 16
+
+// number of edge events the kernel can buffer for us across all lines
+#define GPIO_EVENT_BUFFER_SIZE 256
+
 // LED to indicate activity
 #define PIN_OUTPUT 2
 
-// each time a signal is requested, a timestamp is recorded here
-#define PATH_SIGNAL_COUNT "/var/lib/signalCounter/count"
+// where the count segments are kept, moved with -d
+#define PATH_SIGNAL_COUNT_DIRECTORY "/var/lib/signalCounter"
+
+// hits are appended to numbered segments in this subdirectory, and each sealed segment is uploaded in turn
+#define SEGMENT_DIRECTORY "segments"
+#define SEGMENT_SUFFIX_LOG ".log"
+// how far through the segment the server has acknowledged, so uploads can resume
+#define SEGMENT_SUFFIX_CURSOR ".cursor"
+// a segment the endpoint refused is kept under this name and not sent again
+#define SEGMENT_SUFFIX_REJECTED ".rejected"
+
+// default bounds on the active segment before it is sealed - bytes, and ms since it was opened
+#define SEGMENT_MAX_BYTES 1048576
+#define SEGMENT_MAX_AGE 3600000
+
+// sealed segments the manifest has room for to start with - it doubles as more are waiting
+#define SEGMENT_MANIFEST_SIZE 64
+
+// with --storage ring, hits are written to this preallocated file in the count directory instead of segments
+#define RING_FILE_NAME "count.ring"
+#define RING_FILE_MAGIC "SCRG"
+#define RING_FILE_VERSION 1
+// a ring that can't be used is moved aside to its name with this added, for someone to look at
+#define RING_SUFFIX_UNUSABLE ".unusable"
+
+// default size of a new ring, in bytes
+#define RING_BYTES 4194304
+
+// most hits that can be staged in RAM, and sent straight from RAM in one go
+#define STAGING_RECORDS 65536
+#define STAGING_UPLOAD_RECORDS 8192
+
+// default number of recently written hits kept in RAM, so they can be posted without reading them back
+#define CACHE_RECORDS 16384
+
+// default upper limits on each POST
+#define UPLOAD_BATCH_BYTES 65536
+#define UPLOAD_BATCH_RECORDS 0
+
+// default connect and whole transfer timeouts for each POST, in ms
+#define UPLOAD_CONNECT_TIMEOUT 10000
+#define UPLOAD_TIMEOUT 60000
+
+// after a failed POST the uploader waits a random time of up to UPLOAD_BACKOFF_BASE * 2^(failures - 1) ms,
+// capped at UPLOAD_BACKOFF_MAX ms
+#define UPLOAD_BACKOFF_BASE 1000
+#define UPLOAD_BACKOFF_MAX 300000
+
+// consecutive failures before the circuit breaker opens, and uploads wait for a probe to succeed
+#define UPLOAD_BREAKER_FAILURES 5
+
+// once a batch has been posted, new hits are held back until this many are waiting or this many ms have passed,
+// so bursts go in fewer POSTs. The first hit after a quiet spell goes straight away
+#define UPLOAD_MAX_EVENTS 4096
+#define UPLOAD_MAX_DELAY 1000
+
+// how many hits can wait to be committed to the count file
+#define COUNT_BUFFER_RECORDS 512
+
+// binary count files start with this
+#define COUNT_FILE_MAGIC "SCNT"
+#define COUNT_FILE_VERSION 1
+#define COUNT_FILE_VERSION_COMPRESSED 2
+
+// how much of the swap file is read at a time while it is posted
+#define UPLOAD_READ_BUFFER_SIZE 4096
+
+// with --compress, bodies of at least this many bytes are compressed
+#define UPLOAD_COMPRESS_MIN_BYTES 4096
+
+// deflate's level, window and memory level. 8KB of history is plenty for count CSV, and keeps deflate's state to
+// 64KB on a Pi Zero
+#define UPLOAD_GZIP_LEVEL 6
+#define UPLOAD_GZIP_WINDOW_BITS 13
+#define UPLOAD_GZIP_MEM_LEVEL 6
+
+// zstd's level and window, 64KB
+#define UPLOAD_ZSTD_LEVEL 3
+#define UPLOAD_ZSTD_WINDOW_LOG 16
+
+// binary upload bodies start with this, then flags saying which columns follow each time
+#define WIRE_MAGIC "SCWB"
+#define WIRE_VERSION 1
+#define WIRE_FLAG_PULSE_WIDTHS 0x01
+#define WIRE_FLAG_CHANNELS 0x02
+
+// urlEncode() works 16 bytes at a time where it can, and may write up to this many bytes past what it encodes
+#define URL_ENCODE_SLACK 16
+
+// most URL encoded CSV kept from the batch in flight, so a retry doesn't have to read and encode it again
+#define UPLOAD_PAYLOAD_MAX_BYTES 4194304
+
+// size classes of the memory pool, and how many blocks of each are set aside at startup. The biggest holds the
+// buffers curl allocates for each transfer, which are UPLOAD_CURL_BUFFER_SIZE (+ 1)
+#define MEM_POOL_CLASSES 8
+#define MEM_POOL_CLASS_SIZES { 32, 64, 128, 256, 512, 1024, 4096, 16448 }
+#define MEM_POOL_CLASS_BLOCKS { 512, 512, 256, 128, 64, 64, 32, 16 }
+
+// curl's send and receive buffers. The body is handed over UPLOAD_READ_BUFFER_SIZE at a time and the response is
+// thrown away, so curl's smallest buffers are enough
+#define UPLOAD_CURL_BUFFER_SIZE 16384
+
+#define PATH_MAC_ADDRESS_ETH0 "/sys/class/net/eth0/address"
+
+// where the signal count CSV string will be posted to
+char endPointUrl[1024];
+
+// count directory and its segment directory, moved with -d
+static char countDirectory[200] = PATH_SIGNAL_COUNT_DIRECTORY;
+static char segmentDirectory[256] = PATH_SIGNAL_COUNT_DIRECTORY "/" SEGMENT_DIRECTORY;
+
+// the active segment is sealed at segmentMaxBytes, or segmentMaxAgeMs after it was opened (0 for no age limit).
+// With segmentRetain > 0, only that many sealed segments are kept and the oldest are dropped
+static long long segmentMaxBytes = SEGMENT_MAX_BYTES;
+static long long segmentMaxAgeMs = SEGMENT_MAX_AGE;
+static long segmentRetain = 0;
+
+// where hits are stored - numbered segment files, or one preallocated, memory mapped ring
+enum storageModes { STORAGE_SEGMENTS, STORAGE_RING };
+
+static enum storageModes storageMode = STORAGE_SEGMENTS;
+static long long ringBytes = RING_BYTES;
+
+// with either set, committed hits are staged in RAM and only written to the card once the oldest is
+// stagingFlushMs old, or there are stagingFlushEvents of them. 0 for no limit
+static long long stagingFlushMs = 0;
+static long stagingFlushEvents = 0;
+
+// upper limits on the size of each POST, in bytes of CSV and in records. 0 records means no limit
+static long long uploadBatchBytes = UPLOAD_BATCH_BYTES;
+static long uploadBatchRecords = UPLOAD_BATCH_RECORDS;
+
+// when hits committed after a POST are sent - see UPLOAD_MAX_EVENTS
+static long uploadMaxEvents = UPLOAD_MAX_EVENTS;
+static long long uploadMaxDelayMs = UPLOAD_MAX_DELAY;
+
+// hits committed since the uploader last looked for something to send
+static atomic_uint uploadPendingEvents;
+
+/**
+ * the main thread's event loop, which runs the uploads and sleeps in epoll_wait until there is something to do:
+ * hits committed by the writer thread (an eventfd), the upload state machine's timer for backoff and batching,
+ * curl's own timer and sockets, the stats timer, and SIGINT, SIGTERM and SIGHUP through a signalfd
+ */
+struct eventLoop {
+    int epollFd;
+    int wakeFd;
+    int uploadTimerFd;
+    int curlTimerFd;
+    int statsTimerFd;
+    int signalFd;
+};
+
+static struct eventLoop eventLoop = { -1, -1, -1, -1, -1, -1 };
+
+// batches started from idle because the uploader had been quiet, a full max events were waiting, or after waiting
+// max delay for more
+static atomic_ullong batchAtOnceCount;
+static atomic_ullong batchFullCount;
+static atomic_ullong batchDelayedCount;
+
+static long uploadConnectTimeoutMs = UPLOAD_CONNECT_TIMEOUT;
+static long uploadTimeoutMs = UPLOAD_TIMEOUT;
+static long backoffBaseMs = UPLOAD_BACKOFF_BASE;
+static long backoffMaxMs = UPLOAD_BACKOFF_MAX;
+static long breakerFailures = UPLOAD_BREAKER_FAILURES;
+
+// file of the settings that can be changed while running (--config), read at startup and again on SIGHUP
+static char configPath[256];
+
+// most lines of settings a config file can have
+#define CONFIG_LINES 64
+
+/**
+ * how the hits are sent
+ *
+ * UPLOAD_BODY_FORM: a URL encoded form, with the MAC address and the CSV as fields
+ * UPLOAD_BODY_CSV: the CSV as it is, with the MAC address in a header. CSV segments are sent straight from a mapping
+ * of the file
+ * UPLOAD_BODY_BINARY: the compact binary wire format - see wireRecordEncode(). Falls back to UPLOAD_BODY_FORM if
+ * the endpoint answers 415
+ */
+enum uploadBodyModes { UPLOAD_BODY_FORM, UPLOAD_BODY_CSV, UPLOAD_BODY_BINARY };
+
+static enum uploadBodyModes uploadBodyMode = UPLOAD_BODY_FORM;
+
+/**
+ * how bodies of at least uploadCompressMinBytes are compressed, sent with a Content-Encoding header. zstd is only
+ * there when built with HAVE_ZSTD
+ */
+enum uploadCompressions { UPLOAD_COMPRESS_NONE, UPLOAD_COMPRESS_GZIP, UPLOAD_COMPRESS_ZSTD };
+
+static enum uploadCompressions uploadCompression = UPLOAD_COMPRESS_NONE;
+static long long uploadCompressMinBytes = UPLOAD_COMPRESS_MIN_BYTES;
+
+// bodies compressed, bytes before and after, and the time spent compressing them
+static atomic_ullong compressBatchCount;
+static atomic_ullong compressBytesIn;
+static atomic_ullong compressBytesOut;
+static atomic_ullong compressTimeUs;
+
+/**
+ * when buffered hits are committed to the count file
+ *
+ * COMMIT_WRITE: write() each hit straight away, leaving it to the kernel to reach the card
+ * COMMIT_SYNC: write() and fdatasync() each hit
+ * COMMIT_EVENTS: write() and fdatasync() every commitPolicyValue hits
+ * COMMIT_INTERVAL: write() and fdatasync() once the oldest buffered hit is commitPolicyValue ms old
+ */
+enum commitPolicies { COMMIT_WRITE, COMMIT_SYNC, COMMIT_EVENTS, COMMIT_INTERVAL };
+
+static enum commitPolicies commitPolicy = COMMIT_WRITE;
+static long int commitPolicyValue = 0;
+
+// the active segment is kept open between hits. Held by the writer while it appends, and by the
+// uploader while it seals a segment or removes one it has sent. Guards the manifest below too
+static pthread_mutex_t countFileMutex = PTHREAD_MUTEX_INITIALIZER;
+static int countFileFd = -1;
+
+// sealed segment ids waiting to be uploaded, oldest first. Rebuilt from the segment directory at startup
+static unsigned long long * segmentManifest = NULL;
+static int segmentManifestCount = 0;
+static int segmentManifestCapacity = 0;
+
+// the segment being appended to, when it was opened (monotonic) and how big it is
+static unsigned long long segmentActiveId = 1;
+static unsigned long long segmentActiveOpenedUs = 0;
+static long long segmentActiveSize = 0;
+
+// the segment the uploader is working through, never dropped by retention. 0 for none
+static unsigned long long segmentUploadingId = 0;
+static atomic_ullong segmentDroppedCount;
+static atomic_ullong segmentRejectedCount;
+
+// the mapped ring file, with --storage ring. Guarded by countFileMutex, other than reading records the uploader
+// has already been told about, which the writer never overwrites
+static struct ringHeader * ringHeader = NULL;
+static unsigned char * ringData = NULL;
+static uint64_t ringCapacity = 0;
+static atomic_ullong ringDroppedCount;
+
+/**
+ * the format count files are written in
+ *
+ * COUNT_FORMAT_CSV: a line of text per hit, as sent to the endpoint
+ * COUNT_FORMAT_BINARY: a countFileHeader, then a fixed size countRecord per hit
+ * COUNT_FORMAT_COMPRESSED: a countFileHeader, then a countBlockHeader and delta-of-delta encoded hits per commit
+ */
+enum countFormats { COUNT_FORMAT_CSV, COUNT_FORMAT_BINARY, COUNT_FORMAT_COMPRESSED };
+
+/**
+ * binary count file header. All fields are little endian
+ */
+struct countFileHeader {
+    char magic[4];
+    uint16_t version;
+    // sizeof(struct countRecord), for readers to check
+    uint16_t recordSize;
+    uint32_t reserved[2];
+};
+
+/**
+ * a recorded hit, as buffered for commit and as written to binary count files
+ */
+struct countRecord {
+    // wall clock time at the end of the pulse
+    uint64_t timeUs;
+    uint32_t pulseWidthUs;
+    uint16_t channel;
+    uint16_t flags;
+    // in ring files, which record of the ring this is, counting every lap
+    uint32_t reserved;
+    // CRC32C of everything above
+    uint32_t crc;
+};
+
+/**
+ * start of each block in a compressed count file, followed by length bytes of encoded hits. The first hit has
+ * its time, pulse width and channel as varints. Each hit after it has the zigzag varint of
+ * (delta-of-delta of its time << 1 | channel changed), the zigzag varint of the change in pulse width, and its
+ * channel as a varint if it changed. A block stands alone, so a bad one only loses its own hits
+ */
+struct countBlockHeader {
+    // COUNT_BLOCK_SYNC, so a reader can find the next block after a header it can't trust
+    uint32_t sync;
+    // CRC32C of everything after it - the rest of the header and the encoded hits
+    uint32_t crc;
+    uint16_t records;
+    uint16_t length;
+};
+
+/**
+ * start of a ring file. Records are stored from dataOffset, as a ring of capacity bytes. head and tail count
+ * bytes written and acknowledged since the ring was created, so head - tail is what is waiting to be uploaded
+ */
+struct ringHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t recordSize;
+    uint64_t dataOffset;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+};
+
+_Static_assert(sizeof(struct countFileHeader) == 16, "count file header must be 16 bytes");
+_Static_assert(sizeof(struct countRecord) == 24, "count record must be 24 bytes");
+_Static_assert(sizeof(struct countBlockHeader) == 12, "count block header must be 12 bytes");
+
+// start of every compressed count file block, "SCBK" on the card
+#define COUNT_BLOCK_SYNC 0x4b424353
+
+// worst case for a block of a whole commit - 10 byte varint time, 5 byte pulse width and 3 byte channel per hit
+#define COUNT_BLOCK_MAX_SIZE (sizeof(struct countBlockHeader) + COUNT_BUFFER_RECORDS * 18)
+
+// where record N starts in a binary count file
+#define COUNT_RECORD_OFFSET(n) ((off_t) sizeof(struct countFileHeader) + (off_t)(n) * (off_t) sizeof(struct countRecord))
+
+// format for new count files, and the format of the count file that is open
+static enum countFormats countFormat = COUNT_FORMAT_CSV;
+static enum countFormats countFileFormat = COUNT_FORMAT_CSV;
+
+static uint32_t crc32cTable[256];
+
+// hits waiting to be committed
+static struct countRecord countBuffer[COUNT_BUFFER_RECORDS];
+static unsigned int countBufferEvents = 0;
+static unsigned long long countBufferOldestUs = 0;
+
+// commits that couldn't write the buffered hits out - they stay buffered for the next one
+static atomic_ullong commitFailedCount;
+
+// hits staged in RAM, oldest first, and when the oldest was staged (monotonic). The first stagingInFlight are
+// being sent by the uploader. Guarded by countFileMutex
+static struct countRecord stagingBuffer[STAGING_RECORDS];
+static unsigned int stagingCount = 0;
+static unsigned int stagingInFlight = 0;
+static unsigned long long stagingOldestUs = 0;
+static atomic_ullong stagingSentCount;
+static atomic_ullong stagingFlushedCount;
+
+/**
+ * a hit recently written to a segment, and where it is in the segment
+ */
+struct cacheEntry {
+    unsigned long long segmentId;
+    // bytes of the segment the hit takes up - every hit in a compressed block has the whole block's
+    long long start;
+    long long end;
+    struct countRecord record;
+};
+
+// the hot tail cache - the last cacheSize hits written to segments, oldest first from cacheFirst. cacheRecords
+// is the size asked for, 0 for no cache, and cacheSize is 0 until the cache is allocated. Guarded by countFileMutex
+static struct cacheEntry * cacheEntries = NULL;
+static long cacheRecords = CACHE_RECORDS;
+static unsigned int cacheSize = 0;
+static unsigned int cacheFirst = 0;
+static unsigned int cacheCount = 0;
+static atomic_ullong cacheHitCount;
+static atomic_ullong cacheMissCount;
+
+// number of us we want signal for before counting as an actual hit (debouncing)
+long long int triggerIntervalUs = 300000;
+
+// number of hits the ISR can queue before the writer thread has to drain them (must be a power of 2)
+#define SIGNAL_RING_SIZE 1024
+
+// maximum number of hits the writer thread takes off the ring in one go
+#define SIGNAL_WRITER_BATCH 64
+
+// how often (in seconds) the main loop prints the capture stats
+#define STATS_INTERVAL 60
+
+// most events taken from epoll per wakeup of the main loop
+#define EVENT_LOOP_EVENTS 16
+
+// each thread that logs gets its own ring of LOG_RING_SIZE messages (a power of 2), up to LOG_RINGS threads
+#define LOG_RINGS 8
+#define LOG_RING_SIZE 128
+
+// longest message kept, anything longer is cut short
+#define LOG_MESSAGE_BYTES 200
+
+// messages each thread can log per second before the rest are dropped and counted, 0 for no limit
+#define LOG_RATE 100
+
+// with --log-file, rotated files kept alongside it (file.1 is the newest)
+#define LOG_FILES 3
+
+/**
+ * a debounced hit, queued by the ISR for the writer thread
+ */
+struct signalEvent {
+    // end of the pulse, CLOCK_MONOTONIC
+    unsigned long long timeUs;
+    unsigned long long intervalUs;
+    int channel;
+};
+
+/**
+ * lock-free single producer (ISR) / single consumer (writer thread) queue of hits.
+ * head and tail are free running counters, masked when indexing into events
+ */
+struct signalRing {
+    struct signalEvent events[SIGNAL_RING_SIZE];
+    // only written by the producer
+    _Alignas(64) atomic_uint head;
+    atomic_uint highWatermark;
+    atomic_ullong overflowCount;
+    // only written by the consumer
+    _Alignas(64) atomic_uint tail;
+};
+
+/**
+ * a GPIO input being counted. Each channel has its own ISR thread, so each gets its own ring
+ * to keep a single producer per ring
+ */
+struct signalChannel {
+    // written to the count file alongside each hit
+    int id;
+    // wiringPi pin number
+    int pin;
+    // INT_EDGE_RISING if the signal is active high, INT_EDGE_FALLING if it is active low
+    int edge;
+    // number of us of signal required before a hit is recorded, -1 to use triggerIntervalUs
+    long long int triggerIntervalUs;
+    // when the current pulse started (CLOCK_MONOTONIC), 0 if there is no pulse in progress
+    unsigned long long interruptTimeUsActive;
+    // last kernel sequence number seen on the GPIO character device, to spot edges the kernel dropped
+    unsigned int lineSeqno;
+    // hits dropped by the debounce check, and hits written to the count file
+    atomic_ullong rejectedCount;
+    atomic_ullong recordedCount;
+    // edges the kernel dropped before we read them (GPIO character device only)
+    atomic_ullong edgeLostCount;
+    struct signalRing ring;
+};
+
+static struct signalChannel channels[CHANNEL_MAX];
+static int channelCount = 0;
+
+// GPIO character device to capture from (e.g. /dev/gpiochip0). Empty to capture with wiringPi interrupts
+static char gpioChipPath[64];
+
+// line request on gpioChipPath, carrying edge events for every channel
+static int gpioLineFd = -1;
+
+// when channels are configured on the command line, the channel id is written as a second CSV column
+static bool recordChannelId = false;
+
+// posted by the ISRs each time a hit is queued, the writer thread sleeps on it
+static sem_t signalRingSemaphore;
+
+// set on shutdown - edges are ignored from then on, and the writer thread drains the rings, posts
+// signalWriterStoppedSemaphore and exits
+static atomic_bool captureStopped;
+static sem_t signalWriterStoppedSemaphore;
+
+/**
+ * how much is logged. Messages above logLevel cost a comparison, their arguments aren't even evaluated
+ */
+enum logLevels { LOG_ERROR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+static enum logLevels logLevel = LOG_INFO;
+
+#define LOG(level, ...) do { if((level) <= logLevel) { logWrite((level), __VA_ARGS__); } } while(0)
+
+/**
+ * a logged message, formatted in place in its ring and timestamped when it was logged
+ */
+struct logRecord {
+    unsigned long long timeUs;
+    enum logLevels level;
+    unsigned int length;
+    char message[LOG_MESSAGE_BYTES];
+};
+
+/**
+ * lock-free single producer (the thread it belongs to) / single consumer (the log thread) queue of messages, as
+ * struct signalRing. The token bucket limiting the thread's rate is only touched by the producer
+ */
+struct logRing {
+    struct logRecord records[LOG_RING_SIZE];
+    // only written by the producer
+    _Alignas(64) atomic_uint head;
+    // messages dropped because the ring was full or the thread was over its rate
+    atomic_ullong lostCount;
+    long long tokens;
+    unsigned long long tokensUs;
+    // only written by the consumer
+    _Alignas(64) atomic_uint tail;
+    unsigned long long lostReported;
+};
+
+static struct logRing logRings[LOG_RINGS];
+static atomic_uint logRingCount;
+static _Thread_local struct logRing * logThreadRing;
+
+// with logRunning set, messages go through the rings to the log thread, otherwise straight to stdout or stderr
+static atomic_bool logRunning;
+static atomic_bool logStopping;
+static pthread_t logThread;
+static sem_t logSemaphore;
+static long logRate = LOG_RATE;
+
+// where the log thread writes - stdout and stderr, or logPath rotated every logMaxBytes (0 never)
+static char logPath[256];
+static long long logMaxBytes = 0;
+static int logFd = -1;
+static long long logFileBytes = 0;
+
+// set by logReopen(), for the log thread to open logPath again once it has written what it has
+static atomic_bool logReopenRequested;
+
+/**
+ * get the current timestamp in milliseconds
+ */
+unsigned long long getCurrentMilliseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (unsigned long long)(ts.tv_sec) * 1000 + (unsigned long long)(ts.tv_nsec) / 1000000;
+}
+
+/**
+ * get the time since boot in microseconds. Unaffected by NTP steps, and served from the vDSO so no syscall
+ */
+unsigned long long getMonotonicMicroseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (unsigned long long)(ts.tv_sec) * 1000000 + (unsigned long long)(ts.tv_nsec) / 1000;
+}
+
+/**
+ * get the current timestamp in microseconds
+ */
+unsigned long long getCurrentMicroseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return (unsigned long long)(ts.tv_sec) * 1000000 + (unsigned long long)(ts.tv_nsec) / 1000;
+}
+
+/**
+ * convert a CLOCK_MONOTONIC timestamp into a wall clock timestamp in microseconds, using the current offset
+ * between the two clocks
+ */
+unsigned long long clockMonotonicToRealtimeUs(unsigned long long monotonicUs)
+{
+    unsigned long long nowUs = getMonotonicMicroseconds();
+    unsigned long long nowRealtimeUs = getCurrentMicroseconds();
+    unsigned long long ageUs = nowUs > monotonicUs ? nowUs - monotonicUs : 0;
+
+    return nowRealtimeUs - ageUs;
+}
+
+/**
+ * take a token from the calling thread's bucket, which fills at logRate a second up to a second's worth. Returns
+ * false if the thread is over its rate
+ */
+static bool logTakeToken(struct logRing * ring)
+{
+    unsigned long long nowUs;
+
+    if(logRate <= 0) {
+        return true;
+    }
+
+    if(ring->tokens <= 0) {
+        nowUs = getMonotonicMicroseconds();
+        ring->tokens += (long long)((nowUs - ring->tokensUs) * logRate / 1000000);
+
+        if(ring->tokens <= 0) {
+            return false;
+        }
+
+        ring->tokensUs = nowUs;
+        if(ring->tokens > logRate) {
+            ring->tokens = logRate;
+        }
+    }
+
+    ring->tokens--;
+
+    return true;
+}
+
+/**
+ * log a message at level, through the LOG() macro. Once the log thread is running this formats into the calling
+ * thread's ring and returns - it never blocks on the card, or on any other thread. Before then, and for threads
+ * beyond LOG_RINGS, it goes straight to stdout or stderr
+ */
+__attribute__((format(printf, 2, 3)))
+void logWrite(enum logLevels level, const char * format, ...)
+{
+    struct logRing * ring = logThreadRing;
+    struct logRecord * record;
+    unsigned int head;
+    unsigned int index;
+    int length;
+    va_list arguments;
+
+    if(!atomic_load_explicit(&logRunning, memory_order_acquire)) {
+        va_start(arguments, format);
+        vfprintf(level <= LOG_WARNING ? stderr : stdout, format, arguments);
+        va_end(arguments);
+        fputc('\n', level <= LOG_WARNING ? stderr : stdout);
+        return;
+    }
+
+    // the first message from a thread claims it a ring
+    if(ring == NULL) {
+        index = atomic_fetch_add_explicit(&logRingCount, 1, memory_order_relaxed);
+
+        if(index >= LOG_RINGS) {
+            atomic_store_explicit(&logRingCount, LOG_RINGS, memory_order_relaxed);
+            va_start(arguments, format);
+            vfprintf(stderr, format, arguments);
+            va_end(arguments);
+            fputc('\n', stderr);
+            return;
+        }
+
+        ring = &logRings[index];
+        ring->tokens = logRate;
+        ring->tokensUs = getMonotonicMicroseconds();
+        logThreadRing = ring;
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if(head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE || !logTakeToken(ring)) {
+        atomic_fetch_add_explicit(&ring->lostCount, 1, memory_order_relaxed);
+        return;
+    }
+
+    record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->timeUs = getCurrentMicroseconds();
+    record->level = level;
+
+    va_start(arguments, format);
+    length = vsnprintf(record->message, sizeof(record->message), format, arguments);
+    va_end(arguments);
+
+    record->length = length < 0 ? 0 : length >= (int) sizeof(record->message) ? sizeof(record->message) - 1 : (unsigned int) length;
+
+    // publish the message to the log thread
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    sem_post(&logSemaphore);
+}
+
+/**
+ * move the log file aside to file.1, file.1 to file.2 and so on, dropping the oldest, and start a new one
+ */
+void logRotate(void)
+{
+    char from[270];
+    char to[270];
+    int i;
+
+    close(logFd);
+
+    for(i = LOG_FILES - 1; i > 0; i--) {
+        snprintf(from, sizeof(from), "%s.%d", logPath, i);
+        snprintf(to, sizeof(to), "%s.%d", logPath, i + 1);
+        rename(from, to);
+    }
+
+    snprintf(to, sizeof(to), "%s.1", logPath);
+    rename(logPath, to);
+
+    logFd = open(logPath, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC | O_CLOEXEC, 0644);
+    logFileBytes = 0;
+}
+
+/**
+ * open logPath again, so a log moved aside by something else (logrotate) is let go of. On failure the log goes
+ * to stdout and stderr
+ */
+void logReopenFile(void)
+{
+    struct stat fileStat;
+
+    close(logFd);
+
+    logFd = open(logPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    logFileBytes = logFd >= 0 && fstat(logFd, &fileStat) == 0 ? fileStat.st_size : 0;
+}
+
+/**
+ * ask the log thread to open the log file again
+ */
+void logReopen(void)
+{
+    if(logPath[0] == 0 || !atomic_load(&logRunning)) {
+        return;
+    }
+
+    atomic_store(&logReopenRequested, true);
+    sem_post(&logSemaphore);
+}
+
+/**
+ * write out what the log thread has gathered, rotating the log file first if it would go over logMaxBytes
+ */
+void logFlush(const char * buffer, size_t length, int fd)
+{
+    ssize_t written;
+
+    if(length == 0) {
+        return;
+    }
+
+    if(logFd >= 0) {
+        if(logMaxBytes > 0 && logFileBytes > 0 && logFileBytes + (long long) length > logMaxBytes) {
+            logRotate();
+        }
+
+        fd = logFd >= 0 ? logFd : STDERR_FILENO;
+        logFileBytes += length;
+    }
+
+    while(length > 0 && (written = write(fd, buffer, length)) > 0) {
+        buffer += written;
+        length -= written;
+    }
+}
+
+/**
+ * the log thread - takes messages off every thread's ring oldest first, and writes them out a few KB at a time,
+ * so the threads that log never wait on the card
+ */
+void * logWriter(void * argument)
+{
+    static const char * levels[] = { "error", "warning", "info", "debug" };
+    char buffer[8192];
+    char stamp[32];
+    size_t length = 0;
+    int bufferFd = -1;
+    int fd;
+    struct logRecord * record;
+    struct logRing * oldest;
+    struct logRing * ring;
+    unsigned long long lost;
+    unsigned int rings;
+    unsigned int i;
+    time_t seconds;
+    struct tm local;
+    bool stopping;
+    sigset_t signals;
+
+    // started before the event loop blocks the signals it reads, so leave them all to it
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for(;;) {
+        stopping = atomic_load(&logStopping);
+
+        if(!stopping) {
+            sem_wait(&logSemaphore);
+        }
+
+        rings = atomic_load(&logRingCount);
+        if(rings > LOG_RINGS) {
+            rings = LOG_RINGS;
+        }
+
+        for(;;) {
+            oldest = NULL;
+
+            for(i = 0; i < rings; i++) {
+                ring = &logRings[i];
+
+                if(atomic_load_explicit(&ring->tail, memory_order_relaxed) == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+                    continue;
+                }
+
+                record = &ring->records[atomic_load_explicit(&ring->tail, memory_order_relaxed) & (LOG_RING_SIZE - 1)];
+                if(oldest == NULL || record->timeUs < oldest->records[atomic_load_explicit(&oldest->tail, memory_order_relaxed) & (LOG_RING_SIZE - 1)].timeUs) {
+                    oldest = ring;
+                }
+            }
+
+            if(oldest == NULL) {
+                break;
+            }
+
+            record = &oldest->records[atomic_load_explicit(&oldest->tail, memory_order_relaxed) & (LOG_RING_SIZE - 1)];
+
+            // errors and warnings go to stderr without a log file
+            fd = record->level <= LOG_WARNING ? STDERR_FILENO : STDOUT_FILENO;
+            if(length + LOG_MESSAGE_BYTES + 128 > sizeof(buffer) || (logFd < 0 && fd != bufferFd)) {
+                logFlush(buffer, length, bufferFd);
+                length = 0;
+            }
+            bufferFd = fd;
+
+            seconds = record->timeUs / 1000000;
+            localtime_r(&seconds, &local);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+            length += snprintf(buffer + length, sizeof(buffer) - length, "%s.%06llu %s %.*s\n",
+                stamp,
+                record->timeUs % 1000000,
+                levels[record->level],
+                (int) record->length,
+                record->message);
+
+            // say how many of this thread's messages were lost since the last one written
+            lost = atomic_load_explicit(&oldest->lostCount, memory_order_relaxed);
+            if(lost != oldest->lostReported) {
+                length += snprintf(buffer + length, sizeof(buffer) - length, "%s.%06llu warning %llu message(s) dropped\n",
+                    stamp,
+                    record->timeUs % 1000000,
+                    lost - oldest->lostReported);
+                oldest->lostReported = lost;
+            }
+
+            // hand the slot back to the thread
+            atomic_store_explicit(&oldest->tail, atomic_load_explicit(&oldest->tail, memory_order_relaxed) + 1, memory_order_release);
+        }
+
+        logFlush(buffer, length, bufferFd);
+        length = 0;
+
+        if(atomic_exchange(&logReopenRequested, false)) {
+            logReopenFile();
+        }
+
+        if(stopping) {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * finish writing everything logged so far and stop the log thread - called at exit
+ */
+void logStop(void)
+{
+    if(!atomic_load(&logRunning)) {
+        return;
+    }
+
+    atomic_store(&logStopping, true);
+    sem_post(&logSemaphore);
+    pthread_join(logThread, NULL);
+    atomic_store(&logRunning, false);
+}
+
+/**
+ * start the log thread, opening logPath if set. Everything logged from here on goes through the rings
+ */
+int logStart(void)
+{
+    struct stat fileStat;
+
+    if(logPath[0] != 0) {
+        logFd = open(logPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+        if(logFd < 0) {
+            fprintf(stderr, "Failed to open %s: %s\n", logPath, strerror(errno));
+            return -1;
+        }
+
+        logFileBytes = fstat(logFd, &fileStat) == 0 ? fileStat.st_size : 0;
+    }
+
+    sem_init(&logSemaphore, 0, 0);
+
+    // anything printed before now goes first
+    fflush(stdout);
+    fflush(stderr);
+
+    if(pthread_create(&logThread, NULL, logWriter, NULL) != 0) {
+        return -1;
+    }
+
+    atomic_store_explicit(&logRunning, true, memory_order_release);
+    atexit(logStop);
+
+    return 0;
+}
+
+/**
+ * one size class of the memory pool - a run of equal sized blocks, the free ones linked through their first bytes
+ */
+struct memPoolClass {
+    char * start;
+    char * end;
+    size_t blockSize;
+    void * freeList;
+    unsigned int blocksUsed;
+};
+
+// memory set aside at startup for everything allocated once we are running, libcurl's allocations included, so
+// months of uploads can't fragment the heap. Allocations that don't fit fall back to the heap, and are counted
+static struct memPoolClass memPoolClasses[MEM_POOL_CLASSES];
+static char * memPoolArena = NULL;
+static char * memPoolArenaEnd = NULL;
+static unsigned int memPoolBlocks = 0;
+static unsigned int memPoolBlocksUsed = 0;
+static unsigned int memPoolHighWatermark = 0;
+static pthread_mutex_t memPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_ullong memHeapAllocationCount;
+
+/**
+ * set aside the memory pool. Must be called before anything is allocated with memAlloc()
+ */
+int memPoolInit(void)
+{
+    static const size_t sizes[MEM_POOL_CLASSES] = MEM_POOL_CLASS_SIZES;
+    static const unsigned int blocks[MEM_POOL_CLASSES] = MEM_POOL_CLASS_BLOCKS;
+    size_t arenaSize = 0;
+    char * block;
+    int c;
+    unsigned int b;
+
+    for(c = 0; c < MEM_POOL_CLASSES; c++) {
+        arenaSize += sizes[c] * blocks[c];
+    }
+
+    memPoolArena = malloc(arenaSize);
+
+    if(memPoolArena == NULL) {
+        return -1;
+    }
+
+    memPoolArenaEnd = memPoolArena + arenaSize;
+    block = memPoolArena;
+
+    for(c = 0; c < MEM_POOL_CLASSES; c++) {
+        memPoolClasses[c].start = block;
+        memPoolClasses[c].blockSize = sizes[c];
+        memPoolClasses[c].freeList = NULL;
+
+        // linked so the lowest addresses are handed out first
+        for(b = blocks[c]; b > 0; b--) {
+            * (void **) (block + (b - 1) * sizes[c]) = memPoolClasses[c].freeList;
+            memPoolClasses[c].freeList = block + (b - 1) * sizes[c];
+        }
+
+        block += sizes[c] * blocks[c];
+        memPoolClasses[c].end = block;
+        memPoolBlocks += blocks[c];
+    }
+
+    return 0;
+}
+
+/**
+ * the size class a pooled block belongs to, NULL if it came from the heap
+ */
+static struct memPoolClass * memPoolClassOf(const void * pointer)
+{
+    int c;
+
+    if((const char *) pointer < memPoolArena || (const char *) pointer >= memPoolArenaEnd) {
+        return NULL;
+    }
+
+    for(c = 0; c < MEM_POOL_CLASSES; c++) {
+        if((const char *) pointer < memPoolClasses[c].end) {
+            return &memPoolClasses[c];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * allocate from the smallest size class with a block free, or the heap if none of them has
+ */
+void * memAlloc(size_t size)
+{
+    void * block = NULL;
+    int c;
+
+    pthread_mutex_lock(&memPoolMutex);
+
+    for(c = 0; c < MEM_POOL_CLASSES && memPoolArena != NULL; c++) {
+        if(memPoolClasses[c].blockSize >= size && memPoolClasses[c].freeList != NULL) {
+            block = memPoolClasses[c].freeList;
+            memPoolClasses[c].freeList = * (void **) block;
+            memPoolClasses[c].blocksUsed++;
+
+            if(++memPoolBlocksUsed > memPoolHighWatermark) {
+                memPoolHighWatermark = memPoolBlocksUsed;
+            }
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&memPoolMutex);
+
+    if(block == NULL) {
+        atomic_fetch_add_explicit(&memHeapAllocationCount, 1, memory_order_relaxed);
+        block = malloc(size);
+    }
+
+    return block;
+}
+
+void memFree(void * pointer)
+{
+    struct memPoolClass * poolClass = memPoolClassOf(pointer);
+
+    if(poolClass == NULL) {
+        free(pointer);
+        return;
+    }
+
+    pthread_mutex_lock(&memPoolMutex);
+    * (void **) pointer = poolClass->freeList;
+    poolClass->freeList = pointer;
+    poolClass->blocksUsed--;
+    memPoolBlocksUsed--;
+    pthread_mutex_unlock(&memPoolMutex);
+}
+
+void * memRealloc(void * pointer, size_t size)
+{
+    struct memPoolClass * poolClass = memPoolClassOf(pointer);
+    void * resized;
+
+    if(pointer == NULL) {
+        return memAlloc(size);
+    }
+
+    if(poolClass == NULL) {
+        atomic_fetch_add_explicit(&memHeapAllocationCount, 1, memory_order_relaxed);
+        return realloc(pointer, size);
+    }
+
+    // still fits in its block
+    if(size <= poolClass->blockSize) {
+        return pointer;
+    }
+
+    resized = memAlloc(size);
+
+    if(resized != NULL) {
+        memcpy(resized, pointer, poolClass->blockSize);
+        memFree(pointer);
+    }
+
+    return resized;
+}
+
+void * memCalloc(size_t count, size_t size)
+{
+    void * block;
+
+    if(size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    block = memAlloc(count * size);
+
+    if(block != NULL) {
+        memset(block, 0, count * size);
+    }
+
+    return block;
+}
+
+char * memStrdup(const char * string)
+{
+    size_t length = strlen(string) + 1;
+    char * copy = memAlloc(length);
+
+    if(copy != NULL) {
+        memcpy(copy, string, length);
+    }
+
+    return copy;
+}
+
+/**
+ * print how much of the memory pool is in use, and how often allocations through the pool have gone to the heap
+ * instead. Once running, that count should stay still - each time it moves, something didn't fit in the pool.
+ * Where glibc can say (2.33 on), the heap actually in use is printed too, which covers everything else that
+ * allocates - the TLS library included
+ */
+void memPrintStats(void)
+{
+    static unsigned long long lastHeapAllocations = 0;
+    unsigned long long heapAllocations = atomic_load(&memHeapAllocationCount);
+    unsigned int used;
+    unsigned int highWatermark;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    static long long lastHeapBytes = 0;
+    struct mallinfo2 heap = mallinfo2();
+    long long heapBytes = heap.uordblks + heap.hblkhd;
+#endif
+
+    pthread_mutex_lock(&memPoolMutex);
+    used = memPoolBlocksUsed;
+    highWatermark = memPoolHighWatermark;
+    pthread_mutex_unlock(&memPoolMutex);
+
+    LOG(LOG_INFO, "stats: memory %u of %u pool blocks in use, high watermark %u, %llu pooled allocations sent to the heap, %llu since the last stats",
+        used,
+        memPoolBlocks,
+        highWatermark,
+        heapAllocations,
+        heapAllocations - lastHeapAllocations);
+
+    lastHeapAllocations = heapAllocations;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    // the pool itself is on the heap, so it is the change that matters
+    LOG(LOG_INFO, "stats: heap %lld bytes in use, %+lld since the last stats",
+        heapBytes,
+        heapBytes - lastHeapBytes);
+
+    lastHeapBytes = heapBytes;
+#endif
+}
+
+/**
+ * create the directory structure leading up to a file
+ */
+void fileCreateDirectories(const char * path)
+{
+    char characterArray[256];
+    char * p;
+    p = NULL;
+    size_t len;
+
+    // convert the string to a 'character array'
+    snprintf(characterArray, sizeof(characterArray), "%s", path);
+
+    len = strlen(characterArray);
+
+    // remove last \n char and null terminate
+    if(characterArray[len - 1] == '/') {
+        characterArray[len - 1] = 0;
+    }
+
+    // loop over each character, via the character pointer
+    for(p = characterArray + 1; * p; p++) {
+        // break at each '/' and create the dir
+        if(* p == '/') {
+            * p = 0;
+            // we're modifiying string's pointer, but how does it know what char to read up to??
+            mkdir(characterArray, 0755);
+            * p = '/';
+        }
+    }
+}
+
+/**
+ * build the CRC32C (Castagnoli) lookup table. Called once from main() before any threads start
+ */
+void crc32cInit(void)
+{
+    uint32_t crc;
+    int i;
+    int bit;
+
+    for(i = 0; i < 256; i++) {
+        crc = i;
+        for(bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32cTable[i] = crc;
+    }
+}
+
+uint32_t crc32c(const void * data, size_t length)
+{
+    const unsigned char * p = data;
+    uint32_t crc = 0xFFFFFFFF;
+
+    while(length--) {
+        crc = crc32cTable[(crc ^ * p++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+/**
+ * the CRC stored with a record covers everything before it
+ */
+uint32_t countRecordCrc(const struct countRecord * record)
+{
+    return crc32c(record, offsetof(struct countRecord, crc));
+}
+
+bool countRecordIsValid(const struct countRecord * record)
+{
+    return record->crc == countRecordCrc(record);
+}
+
+/**
+ * format a record as a line of the count CSV, as the endpoint expects. Returns the length of the line
+ */
+int countRecordToCsv(const struct countRecord * record, char * line, size_t lineSize)
+{
+    // convert us to s
+    if(recordChannelId) {
+        return snprintf(line, lineSize, "%llu,%d\n", (unsigned long long)(record->timeUs / 1000000), record->channel);
+    }
+
+    return snprintf(line, lineSize, "%llu\n", (unsigned long long)(record->timeUs / 1000000));
+}
+
+static inline size_t varintEncode(uint64_t value, unsigned char * output)
+{
+    size_t length = 0;
+
+    while(value >= 0x80) {
+        output[length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+
+    output[length++] = value;
+
+    return length;
+}
+
+static inline int varintDecode(const unsigned char ** input, const unsigned char * end, uint64_t * value)
+{
+    unsigned int shift = 0;
+
+    * value = 0;
+
+    while(* input < end && shift < 64) {
+        * value |= (uint64_t)(** input & 0x7F) << shift;
+
+        if((* (* input)++ & 0x80) == 0) {
+            return 0;
+        }
+
+        shift += 7;
+    }
+
+    return -1;
+}
+
+static inline uint64_t zigzagEncode(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzagDecode(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * encode hits as a compressed count file block, header included. Returns its size, at most COUNT_BLOCK_MAX_SIZE
+ */
+size_t countBlockEncode(const struct countRecord * records, unsigned int count, unsigned char * block)
+{
+    struct countBlockHeader header;
+    unsigned char * p = block + sizeof(header);
+    int64_t delta = 0;
+    int64_t previousDelta = 0;
+    bool channelChanged;
+    unsigned int i;
+
+    p += varintEncode(records[0].timeUs, p);
+    p += varintEncode(records[0].pulseWidthUs, p);
+    p += varintEncode(records[0].channel, p);
+
+    // regular hits have a delta-of-delta near 0 and the same channel, and take 2 bytes
+    for(i = 1; i < count; i++) {
+        delta = (int64_t)(records[i].timeUs - records[i - 1].timeUs);
+        channelChanged = records[i].channel != records[i - 1].channel;
+
+        p += varintEncode(zigzagEncode(delta - previousDelta) << 1 | channelChanged, p);
+        p += varintEncode(zigzagEncode((int64_t) records[i].pulseWidthUs - (int64_t) records[i - 1].pulseWidthUs), p);
+
+        if(channelChanged) {
+            p += varintEncode(records[i].channel, p);
+        }
+
+        previousDelta = delta;
+    }
+
+    header.sync = COUNT_BLOCK_SYNC;
+    header.records = count;
+    header.length = p - block - sizeof(header);
+    memcpy(block, &header, sizeof(header));
+
+    header.crc = crc32c(block + offsetof(struct countBlockHeader, records), p - block - offsetof(struct countBlockHeader, records));
+    memcpy(block, &header, sizeof(header));
+
+    return p - block;
+}
+
+/**
+ * decode a compressed count file block, header included, into records. The block's CRC has already been checked
+ * by fileReadCountBlock(). Returns how many, or -1 if the block is corrupt
+ */
+int countBlockDecode(const unsigned char * block, struct countRecord * records)
+{
+    struct countBlockHeader header;
+    const unsigned char * p = block + sizeof(header);
+    const unsigned char * end;
+    uint64_t timeUs;
+    uint64_t pulseWidthUs;
+    uint64_t channel;
+    uint64_t value;
+    uint64_t pulseWidthChange;
+    int64_t delta = 0;
+    unsigned int i;
+
+    memcpy(&header, block, sizeof(header));
+    end = p + header.length;
+
+    if(varintDecode(&p, end, &timeUs) < 0 || varintDecode(&p, end, &pulseWidthUs) < 0 || varintDecode(&p, end, &channel) < 0) {
+        return -1;
+    }
+
+    for(i = 0; i < header.records; i++) {
+        if(i > 0) {
+            if(varintDecode(&p, end, &value) < 0 || varintDecode(&p, end, &pulseWidthChange) < 0) {
+                return -1;
+            }
+
+            if((value & 1) && varintDecode(&p, end, &channel) < 0) {
+                return -1;
+            }
+
+            delta += zigzagDecode(value >> 1);
+            timeUs += delta;
+            pulseWidthUs += zigzagDecode(pulseWidthChange);
+        }
+
+        memset(&records[i], 0, sizeof(records[i]));
+        records[i].timeUs = timeUs;
+        records[i].pulseWidthUs = pulseWidthUs;
+        records[i].channel = channel;
+        records[i].crc = countRecordCrc(&records[i]);
+    }
+
+    return header.records;
+}
+
+/**
+ * work out which format a count file is in from its first bytes
+ */
+enum countFormats fileGetCountFormat(int fd)
+{
+    struct countFileHeader header;
+
+    if(pread(fd, &header, sizeof(header), 0) == sizeof(header) && memcmp(header.magic, COUNT_FILE_MAGIC, sizeof(header.magic)) == 0) {
+        return header.version == COUNT_FILE_VERSION_COMPRESSED ? COUNT_FORMAT_COMPRESSED : COUNT_FORMAT_BINARY;
+    }
+
+    return COUNT_FORMAT_CSV;
+}
+
+/**
+ * read exactly length bytes, unless the end of the file comes first. Returns the number of bytes read, or -1
+ */
+ssize_t fileReadFully(int fd, void * buffer, size_t length)
+{
+    size_t total = 0;
+    ssize_t bytesRead;
+
+    while(total < length) {
+        bytesRead = read(fd, (char *) buffer + total, length - total);
+
+        if(bytesRead < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if(bytesRead == 0) {
+            break;
+        }
+
+        total += bytesRead;
+    }
+
+    return total;
+}
+
+/**
+ * is there a whole block at the start of buffer, which holds length bytes? Its header has to make sense and its
+ * CRC has to match
+ */
+static bool countBlockIsValid(const unsigned char * buffer, size_t length)
+{
+    struct countBlockHeader header;
+
+    if(length < sizeof(header)) {
+        return false;
+    }
+
+    memcpy(&header, buffer, sizeof(header));
+
+    return header.sync == COUNT_BLOCK_SYNC && header.records > 0 && header.records <= COUNT_BUFFER_RECORDS
+        && header.length <= length - sizeof(header)
+        && header.crc == crc32c(buffer + offsetof(struct countBlockHeader, records), header.length + sizeof(header) - offsetof(struct countBlockHeader, records));
+}
+
+/**
+ * read the next good compressed count file block from the current offset into block, which holds
+ * COUNT_BLOCK_MAX_SIZE. The header is read first and then only the length it gives, so a good block costs two
+ * reads. Anything that isn't a good block - a torn write, or a block that fails its CRC - is stepped over by
+ * looking for the next COUNT_BLOCK_SYNC, and * skipped set to how many bytes that was.
+ * Returns the block's size, 0 at the end of the file (with * skipped the bytes after the last good block), or -1
+ * if the file can't be read. The file is left just after the block
+ */
+ssize_t fileReadCountBlock(int fd, unsigned char * block, off_t * skipped)
+{
+    struct countBlockHeader header;
+    uint32_t sync;
+    ssize_t bytesRead;
+    ssize_t i;
+    off_t start;
+    off_t position;
+
+    start = lseek(fd, 0, SEEK_CUR);
+    position = start;
+
+    if(start < 0) {
+        return -1;
+    }
+
+    while(true) {
+        * skipped = position - start;
+
+        if((bytesRead = fileReadFully(fd, block, sizeof(header))) < 0) {
+            return -1;
+        }
+
+        if(bytesRead == 0) {
+            return 0;
+        }
+
+        memcpy(&header, block, sizeof(header));
+
+        if(bytesRead == sizeof(header) && header.sync == COUNT_BLOCK_SYNC && header.length <= COUNT_BLOCK_MAX_SIZE - sizeof(header)) {
+            if((bytesRead = fileReadFully(fd, block + sizeof(header), header.length)) < 0) {
+                return -1;
+            }
+
+            if(countBlockIsValid(block, sizeof(header) + bytesRead)) {
+                return sizeof(header) + header.length;
+            }
+        }
+
+        // not a good block - carry on from the next marker. One straddling the end of what was read is found by
+        // the next read
+        if(lseek(fd, position, SEEK_SET) < 0 || (bytesRead = fileReadFully(fd, block, COUNT_BLOCK_MAX_SIZE)) < 0) {
+            return -1;
+        }
+
+        for(i = 1; i + (ssize_t) sizeof(sync) <= bytesRead; i++) {
+            memcpy(&sync, block + i, sizeof(sync));
+
+            if(sync == COUNT_BLOCK_SYNC) {
+                break;
+            }
+        }
+
+        position += i;
+
+        if(lseek(fd, position, SEEK_SET) < 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * cut any torn records (a partial record, or records failing their CRC) off the end of a binary count file,
+ * or whatever follows the last good block of a compressed one, as a power cut mid-commit would leave them.
+ * Only ever the tail - a bad block with good blocks after it is left for readers to step over. Called once at
+ * startup, for the segment that was being written when signalCounter last stopped
+ */
+int fileRepairCountFile(const char * path)
+{
+    static unsigned char block[COUNT_BLOCK_MAX_SIZE];
+    struct countRecord record;
+    struct stat fileStat;
+    enum countFormats format;
+    long long records;
+    long long checked = 0;
+    ssize_t blockSize;
+    off_t skipped;
+    off_t size;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+
+    if(fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    format = fileGetCountFormat(fd);
+
+    if(fstat(fd, &fileStat) < 0 || fileStat.st_size < (off_t) sizeof(struct countFileHeader) || format == COUNT_FORMAT_CSV) {
+        close(fd);
+        return 0;
+    }
+
+    if(format == COUNT_FORMAT_COMPRESSED) {
+        // walk the blocks to the end of the last good one
+        size = lseek(fd, sizeof(struct countFileHeader), SEEK_SET);
+
+        while((blockSize = fileReadCountBlock(fd, block, &skipped)) > 0) {
+            size += skipped + blockSize;
+        }
+
+        if(blockSize < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    else {
+        // O(1) to find record N - everything after the header is whole records
+        records = (fileStat.st_size - sizeof(struct countFileHeader)) / sizeof(struct countRecord);
+
+        // a commit writes at most a buffer's worth of records, so that is as far back as a tear can go
+        while(records > 0 && checked < COUNT_BUFFER_RECORDS) {
+            if(pread(fd, &record, sizeof(record), COUNT_RECORD_OFFSET(records - 1)) != sizeof(record)) {
+                break;
+            }
+
+            if(countRecordIsValid(&record)) {
+                break;
+            }
+
+            records--;
+            checked++;
+        }
+
+        size = COUNT_RECORD_OFFSET(records);
+    }
+
+    if(size != fileStat.st_size) {
+        LOG(LOG_INFO, "truncating %lld bytes of torn %s from %s", (long long)(fileStat.st_size - size), format == COUNT_FORMAT_COMPRESSED ? "blocks" : "records", path);
+
+        if(ftruncate(fd, size) < 0 || fdatasync(fd) < 0) {
+            LOG(LOG_ERROR, "Failed to truncate %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+/**
+ * write a count file out as CSV, whatever its format
+ */
+int fileConvertToCsv(const char * path, FILE * output)
+{
+    struct countRecord records[UPLOAD_READ_BUFFER_SIZE / sizeof(struct countRecord)];
+    static struct countRecord blockRecords[COUNT_BUFFER_RECORDS];
+    static unsigned char block[COUNT_BLOCK_MAX_SIZE];
+    enum countFormats format;
+    char line[64];
+    ssize_t bytesRead;
+    off_t skipped;
+    size_t count;
+    size_t i;
+    int decoded;
+    int d;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) {
+        LOG(LOG_ERROR, "Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    format = fileGetCountFormat(fd);
+
+    if(format == COUNT_FORMAT_CSV) {
+        while((bytesRead = fileReadFully(fd, records, sizeof(records))) > 0) {
+            fwrite(records, 1, bytesRead, output);
+        }
+    }
+    else if(format == COUNT_FORMAT_COMPRESSED) {
+        lseek(fd, sizeof(struct countFileHeader), SEEK_SET);
+
+        // a bad block is stepped over, the blocks after it are still good
+        while((bytesRead = fileReadCountBlock(fd, block, &skipped)) > 0) {
+            decoded = countBlockDecode(block, blockRecords);
+
+            for(d = 0; d < decoded; d++) {
+                fwrite(line, 1, countRecordToCsv(&blockRecords[d], line, sizeof(line)), output);
+            }
+        }
+    }
+    else {
+        lseek(fd, sizeof(struct countFileHeader), SEEK_SET);
+
+        while((bytesRead = fileReadFully(fd, records, sizeof(records))) > 0) {
+            count = bytesRead / sizeof(records[0]);
+
+            for(i = 0; i < count; i++) {
+                if(countRecordIsValid(&records[i])) {
+                    fwrite(line, 1, countRecordToCsv(&records[i], line, sizeof(line)), output);
+                }
+            }
+        }
+    }
+
+    close(fd);
+
+    return bytesRead < 0 ? -1 : 0;
+}
+
+/**
+ * build the path of a segment's file - suffix is SEGMENT_SUFFIX_LOG, SEGMENT_SUFFIX_CURSOR or SEGMENT_SUFFIX_REJECTED
+ */
+void segmentPath(char * path, size_t pathSize, unsigned long long id, const char * suffix)
+{
+    snprintf(path, pathSize, "%s/%010llu%s", segmentDirectory, id, suffix);
+}
+
+/**
+ * add a segment to the end of the manifest, making room for it if need be. Must hold countFileMutex
+ */
+int segmentManifestAppend(unsigned long long id)
+{
+    unsigned long long * manifest;
+    int capacity;
+
+    if(segmentManifestCount == segmentManifestCapacity) {
+        capacity = segmentManifestCapacity > 0 ? segmentManifestCapacity * 2 : SEGMENT_MANIFEST_SIZE;
+        manifest = memRealloc(segmentManifest, capacity * sizeof(segmentManifest[0]));
+
+        if(manifest == NULL) {
+            LOG(LOG_ERROR, "Unable to grow the segment manifest to %d segments", capacity);
+            return -1;
+        }
+
+        segmentManifest = manifest;
+        segmentManifestCapacity = capacity;
+    }
+
+    segmentManifest[segmentManifestCount++] = id;
+
+    return 0;
+}
+
+/**
+ * drop a segment from the manifest. Must hold countFileMutex
+ */
+void segmentManifestRemove(unsigned long long id)
+{
+    int i;
+
+    for(i = 0; i < segmentManifestCount; i++) {
+        if(segmentManifest[i] == id) {
+            memmove(&segmentManifest[i], &segmentManifest[i + 1], (segmentManifestCount - i - 1) * sizeof(segmentManifest[0]));
+            segmentManifestCount--;
+            return;
+        }
+    }
+}
+
+/**
+ * delete a segment and its cursor, or with rejected set, move it aside so it is kept but never sent again.
+ * Must hold countFileMutex
+ */
+void segmentDelete(unsigned long long id, bool rejected)
+{
+    char path[300];
+    char rejectedPath[300];
+
+    // the cursor goes first - a stale cursor must never be applied to a segment
+    segmentPath(path, sizeof(path), id, SEGMENT_SUFFIX_CURSOR);
+    remove(path);
+
+    segmentPath(path, sizeof(path), id, SEGMENT_SUFFIX_LOG);
+
+    if(rejected) {
+        segmentPath(rejectedPath, sizeof(rejectedPath), id, SEGMENT_SUFFIX_REJECTED);
+        if(rename(path, rejectedPath) < 0) {
+            LOG(LOG_INFO, "failed to move aside segment %llu", id);
+        }
+    }
+    else if(remove(path) < 0) {
+        LOG(LOG_INFO, "failed to delete segment %llu", id);
+        //@todo record this properly
+    }
+
+    segmentManifestRemove(id);
+}
+
+/**
+ * close the active segment and queue it for upload. The next commit starts a new segment.
+ * Must hold countFileMutex
+ */
+void segmentSealActive(void)
+{
+    bool dropped = false;
+    int oldest;
+
+    if(countFileFd < 0) {
+        // nothing has been written since the last seal
+        return;
+    }
+
+    // out of memory for the manifest - keep appending to the active segment rather than lose track of it
+    if(segmentManifestAppend(segmentActiveId) < 0) {
+        return;
+    }
+
+    if(commitPolicy != COMMIT_WRITE && fdatasync(countFileFd) < 0) {
+        LOG(LOG_ERROR, "Failed to sync segment: %s", strerror(errno));
+    }
+
+    close(countFileFd);
+    countFileFd = -1;
+
+    segmentActiveId++;
+
+    // retention - drop the oldest segments beyond the limit. The one being uploaded is never dropped, and doesn't
+    // count towards the limit, so the newest are never dropped to make room for it
+    while(segmentRetain > 0 && segmentManifestCount > segmentRetain) {
+        oldest = segmentManifest[0] != segmentUploadingId ? 0 : 1;
+
+        if(segmentManifestCount - oldest <= segmentRetain) {
+            if(!dropped) {
+                LOG(LOG_INFO, "keeping %d segments waiting, segment %llu is being uploaded", segmentManifestCount, segmentUploadingId);
+            }
+            break;
+        }
+
+        dropped = true;
+
+        LOG(LOG_INFO, "dropping segment %llu, more than %ld segments waiting", segmentManifest[oldest], segmentRetain);
+        atomic_fetch_add_explicit(&segmentDroppedCount, 1, memory_order_relaxed);
+        segmentDelete(segmentManifest[oldest], false);
+    }
+}
+
+/**
+ * seal the active segment if it has reached its size or age bound. Must hold countFileMutex
+ */
+void segmentSealIfDue(void)
+{
+    if(countFileFd < 0) {
+        return;
+    }
+
+    if(segmentActiveSize >= segmentMaxBytes
+        || (segmentMaxAgeMs > 0 && getMonotonicMicroseconds() - segmentActiveOpenedUs >= (unsigned long long) segmentMaxAgeMs * 1000)) {
+        segmentSealActive();
+    }
+}
+
+/**
+ * a record read back from the ring at offset is only valid if it was written on this lap of the ring - after
+ * a power cut the head can be ahead of records that never reached the card, leaving last lap's records there
+ */
+bool ringRecordIsValid(const struct countRecord * record, uint64_t offset)
+{
+    return countRecordIsValid(record) && record->reserved == (uint32_t)(offset / sizeof(struct countRecord));
+}
+
+/**
+ * sync part of the ring to the card. offset and length are in ring (logical) bytes, and can wrap
+ */
+void ringSync(uint64_t offset, size_t length)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t position;
+    size_t chunk;
+    uintptr_t start;
+
+    while(length > 0) {
+        position = offset % ringCapacity;
+        chunk = length < ringCapacity - position ? length : ringCapacity - position;
+
+        // msync() takes whole pages
+        start = (uintptr_t)(ringData + position) & ~(uintptr_t)(pageSize - 1);
+        if(msync((void *) start, (uintptr_t)(ringData + position + chunk) - start, MS_SYNC) < 0) {
+            LOG(LOG_ERROR, "Failed to sync ring: %s", strerror(errno));
+        }
+
+        offset += chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * copy length bytes out of the ring from * offset, moving * offset past them. Returns length
+ */
+ssize_t ringRead(uint64_t * offset, void * buffer, size_t length)
+{
+    size_t copied = 0;
+    size_t position;
+    size_t chunk;
+
+    while(copied < length) {
+        position = * offset % ringCapacity;
+        chunk = length - copied < ringCapacity - position ? length - copied : ringCapacity - position;
+
+        memcpy((char *) buffer + copied, ringData + position, chunk);
+
+        * offset += chunk;
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+/**
+ * append records at the head of the ring. If the ring is full (uploads have fallen a whole ring behind) the
+ * hits that don't fit are dropped - the records still waiting to be uploaded are never overwritten.
+ * Only the records are synced - each is stamped with its place in the ring, so ringOpen() can find a head
+ * that didn't reach the card, and a commit costs one page write rather than two. Returns how many records were
+ * written. Must hold countFileMutex
+ */
+int ringAppend(const struct countRecord * records, unsigned int count, bool sync)
+{
+    struct countRecord record;
+    uint64_t head = ringHeader->head;
+    size_t length;
+    size_t position;
+    unsigned int room;
+    unsigned int i;
+
+    room = (ringCapacity - (head - ringHeader->tail)) / sizeof(struct countRecord);
+
+    if(count > room) {
+        atomic_fetch_add_explicit(&ringDroppedCount, count - room, memory_order_relaxed);
+        count = room;
+    }
+
+    // the capacity is whole records, so a record never straddles the end of the ring
+    for(i = 0; i < count; i++) {
+        record = records[i];
+        record.reserved = (uint32_t)((head + i * sizeof(struct countRecord)) / sizeof(struct countRecord));
+        record.crc = countRecordCrc(&record);
+
+        position = (head + i * sizeof(struct countRecord)) % ringCapacity;
+        memcpy(ringData + position, &record, sizeof(struct countRecord));
+    }
+
+    length = count * sizeof(struct countRecord);
+
+    if(sync && length > 0) {
+        ringSync(head, length);
+    }
+
+    ringHeader->head = head + length;
+
+    return count;
+}
+
+/**
+ * the uploader has had everything before tail acknowledged - free it up for the writer. This also writes
+ * the head back. Must hold countFileMutex
+ */
+void ringSetTail(uint64_t tail)
+{
+    ringHeader->tail = tail;
+
+    if(msync(ringHeader, sizeof(* ringHeader), MS_SYNC) < 0) {
+        LOG(LOG_ERROR, "Failed to sync ring header: %s", strerror(errno));
+    }
+}
+
+/**
+ * open the ring file, creating and preallocating it at ringBytes if it doesn't exist, and map it.
+ * An existing ring keeps its size, so nothing waiting to be uploaded is lost if --ring-bytes changes. One that
+ * can't be used - a bad header, or shorter than its header says - is moved aside rather than overwritten
+ */
+int ringOpen(const char * path)
+{
+    struct ringHeader header;
+    struct stat fileStat;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    char unusablePath[300];
+    void * map;
+    int fd;
+    int i;
+
+    fileCreateDirectories(path);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if(fd < 0 || fstat(fd, &fileStat) < 0) {
+        LOG(LOG_ERROR, "Failed to open %s: %s", path, strerror(errno));
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    // mapping past the end of the file would SIGBUS on the first access
+    if(fileStat.st_size > 0 && (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, RING_FILE_MAGIC, sizeof(header.magic)) != 0
+        || header.recordSize != sizeof(struct countRecord) || header.dataOffset % pageSize != 0
+        || header.capacity == 0 || header.capacity % sizeof(struct countRecord) != 0
+        || header.head - header.tail > header.capacity
+        || header.dataOffset > (uint64_t) fileStat.st_size || header.capacity > (uint64_t) fileStat.st_size - header.dataOffset)) {
+        close(fd);
+
+        // don't move it over one moved aside before
+        snprintf(unusablePath, sizeof(unusablePath), "%s%s", path, RING_SUFFIX_UNUSABLE);
+
+        for(i = 1; access(unusablePath, F_OK) == 0; i++) {
+            snprintf(unusablePath, sizeof(unusablePath), "%s%s.%d", path, RING_SUFFIX_UNUSABLE, i);
+        }
+
+        if(rename(path, unusablePath) < 0) {
+            LOG(LOG_ERROR, "%s is not a usable ring, and could not be moved aside: %s", path, strerror(errno));
+            return -1;
+        }
+
+        LOG(LOG_ERROR, "%s is not a usable ring, moved it to %s and starting a new one", path, unusablePath);
+
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+        if(fd < 0) {
+            LOG(LOG_ERROR, "Failed to open %s: %s", path, strerror(errno));
+            return -1;
+        }
+
+        fileStat.st_size = 0;
+    }
+
+    if(fileStat.st_size == 0) {
+        // the header gets a page to itself, so syncing it never rewrites records
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, RING_FILE_MAGIC, sizeof(header.magic));
+        header.version = RING_FILE_VERSION;
+        header.recordSize = sizeof(struct countRecord);
+        header.dataOffset = pageSize;
+        header.capacity = ringBytes - ringBytes % sizeof(struct countRecord);
+
+        // allocate every block up front, so appending never touches the filesystem's metadata
+        errno = posix_fallocate(fd, 0, header.dataOffset + header.capacity);
+
+        if(errno != 0 || ftruncate(fd, header.dataOffset + header.capacity) < 0
+            || pwrite(fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(fd) < 0) {
+            LOG(LOG_ERROR, "Failed to create %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    map = mmap(NULL, header.dataOffset + header.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    // the mapping keeps the file open
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        LOG(LOG_ERROR, "Failed to map %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    ringHeader = map;
+    ringData = (unsigned char *) map + header.dataOffset;
+    ringCapacity = header.capacity;
+
+    // the head on the card can be behind records that were synced after it was last written back
+    while(ringHeader->head - ringHeader->tail < ringCapacity
+        && ringRecordIsValid((const struct countRecord *)(ringData + ringHeader->head % ringCapacity), ringHeader->head)) {
+        ringHeader->head += sizeof(struct countRecord);
+    }
+
+    LOG(LOG_INFO, "using ring %s, %llu of %llu bytes waiting to be uploaded",
+        path,
+        (unsigned long long)(ringHeader->head - ringHeader->tail),
+        (unsigned long long) ringCapacity);
+
+    return 0;
+}
+
+void ringClose(void)
+{
+    if(ringHeader != NULL) {
+        munmap(ringHeader, ringHeader->dataOffset + ringCapacity);
+        ringHeader = NULL;
+        ringData = NULL;
+    }
+}
+
+/**
+ * open the active segment for append, if it isn't already open. A new segment is started in countFormat, an
+ * existing one is carried on in whatever format it was started in. Must hold countFileMutex
+ */
+int fileOpenCountFile(void)
+{
+    struct countFileHeader header;
+    struct stat fileStat;
+    char path[300];
+
+    if(countFileFd >= 0) {
+        return 0;
+    }
+
+    segmentPath(path, sizeof(path), segmentActiveId, SEGMENT_SUFFIX_LOG);
+
+    // only pay for the mkdir() walk when a segment is opened, not per hit
+    fileCreateDirectories(path);
+
+    countFileFd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+    if(countFileFd < 0 || fstat(countFileFd, &fileStat) < 0) {
+        LOG(LOG_ERROR, "Failed to open count file: %s", strerror(errno));
+        if(countFileFd >= 0) {
+            close(countFileFd);
+            countFileFd = -1;
+        }
+        return -1;
+    }
+
+    segmentActiveOpenedUs = getMonotonicMicroseconds();
+    segmentActiveSize = fileStat.st_size;
+
+    if(fileStat.st_size > 0) {
+        countFileFormat = fileGetCountFormat(countFileFd);
+        return 0;
+    }
+
+    countFileFormat = countFormat;
+
+    if(countFileFormat != COUNT_FORMAT_CSV) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, COUNT_FILE_MAGIC, sizeof(header.magic));
+        if(countFileFormat == COUNT_FORMAT_COMPRESSED) {
+            // records vary in size, there is no recordSize
+            header.version = COUNT_FILE_VERSION_COMPRESSED;
+        }
+        else {
+            header.version = COUNT_FILE_VERSION;
+            header.recordSize = sizeof(struct countRecord);
+        }
+
+        if(write(countFileFd, &header, sizeof(header)) != sizeof(header)) {
+            LOG(LOG_ERROR, "Failed to write count file header: %s", strerror(errno));
+            // a part header would be taken for CSV - the next open writes it again if the file is empty, or
+            // starts it again if it is gone
+            if(ftruncate(countFileFd, 0) < 0) {
+                LOG(LOG_ERROR, "Failed to truncate count file: %s", strerror(errno));
+                remove(path);
+            }
+            close(countFileFd);
+            countFileFd = -1;
+            return -1;
+        }
+
+        segmentActiveSize = sizeof(header);
+    }
+
+    return 0;
+}
+
+/**
+ * remember a hit just written to a segment, evicting the oldest if the cache is full. Must hold countFileMutex
+ */
+void cacheAppend(unsigned long long segmentId, const struct countRecord * record, long long start, long long end)
+{
+    struct cacheEntry * entry;
+
+    if(cacheCount == cacheSize) {
+        cacheFirst = (cacheFirst + 1) % cacheSize;
+        cacheCount--;
+    }
+
+    entry = &cacheEntries[(cacheFirst + cacheCount) % cacheSize];
+    entry->segmentId = segmentId;
+    entry->start = start;
+    entry->end = end;
+    entry->record = * record;
+
+    cacheCount++;
+}
+
+/**
+ * find the first cached hit that starts at offset in a segment. Entries are in the order they were written, so
+ * sorted by segment and offset. Returns its position after cacheFirst, or -1 if it has been evicted (or was
+ * written before this run). Must hold countFileMutex
+ */
+int cacheFind(unsigned long long segmentId, long long offset)
+{
+    const struct cacheEntry * entry;
+    unsigned int low = 0;
+    unsigned int high = cacheCount;
+    unsigned int middle;
+
+    while(low < high) {
+        middle = low + (high - low) / 2;
+        entry = &cacheEntries[(cacheFirst + middle) % cacheSize];
+
+        if(entry->segmentId < segmentId || (entry->segmentId == segmentId && entry->start < offset)) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    if(low == cacheCount) {
+        return -1;
+    }
+
+    entry = &cacheEntries[(cacheFirst + low) % cacheSize];
+
+    return entry->segmentId == segmentId && entry->start == offset ? (int) low : -1;
+}
+
+/**
+ * take hits that were counted as recorded off their channels' counts, once they have been dropped after all
+ */
+void signalChannelsUncount(const struct countRecord * records, unsigned int count)
+{
+    unsigned int i;
+    int c;
+
+    for(i = 0; i < count; i++) {
+        for(c = 0; c < channelCount; c++) {
+            if(channels[c].id == records[i].channel) {
+                atomic_fetch_sub_explicit(&channels[c].recordedCount, 1, memory_order_relaxed);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * write records to the ring or the active segment, and if sync is set wait for them to reach the card.
+ * At most COUNT_BUFFER_RECORDS at a time. Must hold countFileMutex
+ */
+int fileWriteRecords(const struct countRecord * records, unsigned int count, bool sync)
+{
+    static char output[COUNT_BUFFER_RECORDS * 64];
+    _Static_assert(sizeof(output) >= COUNT_BLOCK_MAX_SIZE, "commit buffer must hold a block");
+    static size_t lineEnds[COUNT_BUFFER_RECORDS];
+    long long start;
+    long long end;
+    size_t outputLength = 0;
+    size_t written = 0;
+    ssize_t bytes;
+    off_t sizeBefore;
+    unsigned int i;
+
+    if(storageMode == STORAGE_RING) {
+        written = ringAppend(records, count, sync);
+
+        // the ring is full - the rest are dropped for good rather than retried, so they aren't recorded
+        if(written < count) {
+            signalChannelsUncount(records + written, count - written);
+        }
+
+        LOG(LOG_DEBUG, "%zu signal(s) recorded to ring", written);
+        return 0;
+    }
+
+    if(fileOpenCountFile() < 0) {
+        return -1;
+    }
+
+    if(countFileFormat == COUNT_FORMAT_BINARY) {
+        outputLength = count * sizeof(struct countRecord);
+        memcpy(output, records, outputLength);
+    }
+    else if(countFileFormat == COUNT_FORMAT_COMPRESSED) {
+        // each commit is one block
+        outputLength = countBlockEncode(records, count, (unsigned char *) output);
+    }
+    else {
+        for(i = 0; i < count; i++) {
+            outputLength += countRecordToCsv(&records[i], output + outputLength, sizeof(output) - outputLength);
+            lineEnds[i] = outputLength;
+        }
+    }
+
+    sizeBefore = lseek(countFileFd, 0, SEEK_END);
+
+    while(written < outputLength) {
+        bytes = write(countFileFd, output + written, outputLength - written);
+
+        if(bytes < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LOG(LOG_ERROR, "Failed to write count file: %s", strerror(errno));
+            // don't leave half a commit behind - the whole buffer is retried by the next commit. If it can't be
+            // cut off, the retry goes to a new segment rather than behind it
+            if(sizeBefore >= 0 && ftruncate(countFileFd, sizeBefore) < 0) {
+                LOG(LOG_ERROR, "Failed to truncate count file: %s", strerror(errno));
+                segmentSealActive();
+            }
+            return -1;
+        }
+
+        written += bytes;
+    }
+
+    if(sync && fdatasync(countFileFd) < 0) {
+        LOG(LOG_ERROR, "Failed to sync count file: %s", strerror(errno));
+    }
+
+    LOG(LOG_DEBUG, "%u signal(s) recorded to file", count);
+
+    // keep the hot tail in RAM, with where each hit is in the segment
+    for(i = 0; i < count && cacheSize > 0 && sizeBefore >= 0; i++) {
+        if(countFileFormat == COUNT_FORMAT_COMPRESSED) {
+            start = 0;
+            end = outputLength;
+        }
+        else if(countFileFormat == COUNT_FORMAT_BINARY) {
+            start = i * sizeof(struct countRecord);
+            end = start + sizeof(struct countRecord);
+        }
+        else {
+            start = i > 0 ? lineEnds[i - 1] : 0;
+            end = lineEnds[i];
+        }
+
+        cacheAppend(segmentActiveId, &records[i], sizeBefore + start, sizeBefore + end);
+    }
+
+    segmentActiveSize += outputLength;
+
+    segmentSealIfDue();
+
+    return 0;
+}
+
+/**
+ * write the staged hits to the card, in order. Only those being sent straight from RAM are held back - they are
+ * dropped once acknowledged, or flushed with the next lot if not. Must hold countFileMutex
+ */
+int stagingFlush(void)
+{
+    unsigned int waiting = stagingCount - stagingInFlight;
+    unsigned int count;
+    unsigned int flushed = 0;
+
+    while(flushed < waiting) {
+        count = waiting - flushed < COUNT_BUFFER_RECORDS ? waiting - flushed : COUNT_BUFFER_RECORDS;
+
+        if(fileWriteRecords(stagingBuffer + stagingInFlight + flushed, count, true) < 0) {
+            break;
+        }
+
+        flushed += count;
+    }
+
+    memmove(stagingBuffer + stagingInFlight, stagingBuffer + stagingInFlight + flushed, (waiting - flushed) * sizeof(stagingBuffer[0]));
+    stagingCount -= flushed;
+    stagingOldestUs = getMonotonicMicroseconds();
+
+    atomic_fetch_add_explicit(&stagingFlushedCount, flushed, memory_order_relaxed);
+
+    return flushed == 0 && waiting > 0 ? -1 : 0;
+}
+
+/**
+ * flush the staged hits if the oldest has been waiting stagingFlushMs, or there are stagingFlushEvents of them.
+ * Must hold countFileMutex
+ */
+void stagingFlushIfDue(void)
+{
+    if(stagingCount == stagingInFlight) {
+        return;
+    }
+
+    if((stagingFlushEvents > 0 && stagingCount - stagingInFlight >= (unsigned int) stagingFlushEvents)
+        || (stagingFlushMs > 0 && getMonotonicMicroseconds() - stagingOldestUs >= (unsigned long long) stagingFlushMs * 1000)) {
+        stagingFlush();
+    }
+}
+
+/**
+ * add hits to the staging buffer. If it is full, it is flushed first - and if that doesn't make room, because
+ * it is all being sent, these hits go straight to the card. Returns -1 if they couldn't be written there, and
+ * they are left with the caller. Must hold countFileMutex
+ */
+int stagingAppend(const struct countRecord * records, unsigned int count)
+{
+    if(stagingCount + count > STAGING_RECORDS) {
+        stagingFlush();
+    }
+
+    if(stagingCount + count > STAGING_RECORDS) {
+        if(fileWriteRecords(records, count, commitPolicy != COMMIT_WRITE) < 0) {
+            LOG(LOG_ERROR, "Staging buffer full and %u signal(s) couldn't be written to file, kept for the next commit", count);
+            return -1;
+        }
+
+        atomic_fetch_add_explicit(&stagingFlushedCount, count, memory_order_relaxed);
+        return 0;
+    }
+
+    if(stagingCount == stagingInFlight) {
+        stagingOldestUs = getMonotonicMicroseconds();
+    }
+
+    memcpy(stagingBuffer + stagingCount, records, count * sizeof(stagingBuffer[0]));
+    stagingCount += count;
+
+    return 0;
+}
+
+/**
+ * tell the uploader count more hits can be sent. It is only woken for the first since it last looked, and again
+ * once there are uploadMaxEvents - anything in between waits for the batch to fill or its delay to pass
+ */
+void uploadNotify(unsigned int count)
+{
+    unsigned int pending = atomic_fetch_add_explicit(&uploadPendingEvents, count, memory_order_relaxed);
+    uint64_t one = 1;
+
+    if(eventLoop.wakeFd < 0) {
+        return;
+    }
+
+    // the eventfd is non-blocking, so this never holds up the writer
+    if(pending == 0 || (pending < (unsigned long) uploadMaxEvents && pending + count >= (unsigned long) uploadMaxEvents)) {
+        if(write(eventLoop.wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            LOG(LOG_ERROR, "Failed to wake the uploader: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * write everything buffered to the count file, and if sync is set wait for it to reach the card. With RAM
+ * staging, it goes to the staging buffer instead. Must hold countFileMutex
+ */
+int fileCommitCountBuffer(bool sync)
+{
+    int returnValue;
+
+    if(countBufferEvents == 0) {
+        return 0;
+    }
+
+    if(stagingFlushMs > 0 || stagingFlushEvents > 0) {
+        returnValue = stagingAppend(countBuffer, countBufferEvents);
+    }
+    else {
+        returnValue = fileWriteRecords(countBuffer, countBufferEvents, sync);
+    }
+
+    if(returnValue < 0) {
+        atomic_fetch_add_explicit(&commitFailedCount, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    uploadNotify(countBufferEvents);
+    countBufferEvents = 0;
+
+    return 0;
+}
+
+/**
+ * commit the buffered hits if the commit policy says they are due. Must hold countFileMutex
+ */
+int fileCommitIfDue(void)
+{
+    int returnValue = 0;
+
+    switch(commitPolicy) {
+        case COMMIT_WRITE:
+            returnValue = fileCommitCountBuffer(false);
+            break;
+        case COMMIT_SYNC:
+            returnValue = fileCommitCountBuffer(true);
+            break;
+        case COMMIT_EVENTS:
+            if(countBufferEvents >= (unsigned int) commitPolicyValue) {
+                returnValue = fileCommitCountBuffer(true);
+            }
+            break;
+        case COMMIT_INTERVAL:
+            if(countBufferEvents > 0 && getMonotonicMicroseconds() - countBufferOldestUs >= (unsigned long long) commitPolicyValue * 1000) {
+                returnValue = fileCommitCountBuffer(true);
+            }
+            break;
+    }
+
+    // staged hits reach the card on their own schedule
+    stagingFlushIfDue();
+
+    return returnValue;
+}
+
+/**
+ * record the signal count to file. The hit is buffered, and written according to the commit policy.
+ * Returns -1 if the buffer is full and couldn't be committed to make room, so the hit was lost
+ */
+int fileRecordSignalCount(unsigned long long interruptTimeUs, unsigned long long pulseWidthUs, int channelId)
+{
+    struct countRecord * record;
+
+    pthread_mutex_lock(&countFileMutex);
+
+    // make room if the buffer is full, whatever the policy
+    if(countBufferEvents == COUNT_BUFFER_RECORDS && fileCommitCountBuffer(commitPolicy != COMMIT_WRITE) < 0) {
+        pthread_mutex_unlock(&countFileMutex);
+        return -1;
+    }
+
+    if(countBufferEvents == 0) {
+        countBufferOldestUs = getMonotonicMicroseconds();
+    }
+
+    record = &countBuffer[countBufferEvents++];
+    memset(record, 0, sizeof(* record));
+    record->timeUs = interruptTimeUs;
+    record->pulseWidthUs = pulseWidthUs > UINT32_MAX ? UINT32_MAX : pulseWidthUs;
+    record->channel = channelId;
+    record->crc = countRecordCrc(record);
+
+    // the hit is recorded once it is buffered - if this commit fails, a later one writes it
+    fileCommitIfDue();
+
+    pthread_mutex_unlock(&countFileMutex);
+
+    return 0;
+}
+
+/**
+ * when the next commit is due under the interval policy, or the staged hits are due to be flushed, in
+ * CLOCK_MONOTONIC us. 0 if nothing is waiting
+ */
+unsigned long long fileCommitDeadlineUs(void)
+{
+    unsigned long long deadlineUs = 0;
+    unsigned long long stagingDeadlineUs;
+
+    pthread_mutex_lock(&countFileMutex);
+
+    if(commitPolicy == COMMIT_INTERVAL && countBufferEvents > 0) {
+        deadlineUs = countBufferOldestUs + (unsigned long long) commitPolicyValue * 1000;
+    }
+
+    // hits being sent from RAM aren't flushed - stagingRelease() wakes the writer in case they weren't sent
+    if(stagingFlushMs > 0 && stagingCount > stagingInFlight) {
+        stagingDeadlineUs = stagingOldestUs + (unsigned long long) stagingFlushMs * 1000;
+
+        if(deadlineUs == 0 || stagingDeadlineUs < deadlineUs) {
+            deadlineUs = stagingDeadlineUs;
+        }
+    }
+
+    pthread_mutex_unlock(&countFileMutex);
+
+    return deadlineUs;
+}
+
+/**
+ * commit anything buffered under the interval policy, and flush anything staged, that has become due
+ */
+void fileCommitTimer(void)
+{
+    pthread_mutex_lock(&countFileMutex);
+    fileCommitIfDue();
+    pthread_mutex_unlock(&countFileMutex);
+}
+
+/**
+ * parse a commit policy of the form write|sync|events:N|ms:T
+ */
+int commitPolicyParse(const char * value)
+{
+    char * p;
+
+    if(strcmp(value, "write") == 0) {
+        commitPolicy = COMMIT_WRITE;
+        return 0;
+    }
+
+    if(strcmp(value, "sync") == 0) {
+        commitPolicy = COMMIT_SYNC;
+        return 0;
+    }
+
+    if(strncmp(value, "events:", 7) == 0) {
+        commitPolicy = COMMIT_EVENTS;
+        value += 7;
+    }
+    else if(strncmp(value, "ms:", 3) == 0) {
+        commitPolicy = COMMIT_INTERVAL;
+        value += 3;
+    }
+    else {
+        return -1;
+    }
+
+    errno = 0;
+    commitPolicyValue = strtol(value, &p, 10);
+
+    if(* p != '\0' || p == value || errno != 0 || commitPolicyValue < 1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * copy up to maxRecords of the oldest staged hits out to be sent straight from RAM. They stay staged, but aren't
+ * flushed, until stagingRelease(). Returns how many were copied
+ */
+unsigned int stagingTake(struct countRecord * records, unsigned int maxRecords)
+{
+    unsigned int count = 0;
+
+    pthread_mutex_lock(&countFileMutex);
+
+    // anything still waiting on the commit policy is staged first
+    fileCommitCountBuffer(false);
+
+    if(stagingInFlight == 0 && stagingCount > 0) {
+        count = stagingCount < maxRecords ? stagingCount : maxRecords;
+        memcpy(records, stagingBuffer, count * sizeof(records[0]));
+        stagingInFlight = count;
+    }
+
+    pthread_mutex_unlock(&countFileMutex);
+
+    return count;
+}
+
+/**
+ * the hits taken by stagingTake() have finished sending. The first sent of them have been acknowledged and are
+ * dropped, the rest are due to be flushed straight away - the writer is woken to do it
+ */
+void stagingRelease(unsigned int sent)
+{
+    pthread_mutex_lock(&countFileMutex);
+
+    if(sent < stagingInFlight) {
+        stagingOldestUs = 0;
+    }
+
+    memmove(stagingBuffer, stagingBuffer + sent, (stagingCount - sent) * sizeof(stagingBuffer[0]));
+    stagingCount -= sent;
+    stagingInFlight = 0;
+
+    pthread_mutex_unlock(&countFileMutex);
+
+    atomic_fetch_add_explicit(&stagingSentCount, sent, memory_order_relaxed);
+
+    sem_post(&signalRingSemaphore);
+}
+
+static int segmentCompare(const void * a, const void * b)
+{
+    unsigned long long idA = * (const unsigned long long *) a;
+    unsigned long long idB = * (const unsigned long long *) b;
+
+    return idA < idB ? -1 : idA > idB;
+}
+
+/**
+ * move a count file from before segments into the segment directory, as the next segment
+ */
+void segmentAdoptLegacyFile(const char * name)
+{
+    char legacyPath[300];
+    char legacyCursorPath[320];
+    char path[300];
+
+    snprintf(legacyPath, sizeof(legacyPath), "%s/%s", countDirectory, name);
+    snprintf(legacyCursorPath, sizeof(legacyCursorPath), "%s.cursor", legacyPath);
+
+    if(access(legacyPath, F_OK) < 0) {
+        return;
+    }
+
+    segmentPath(path, sizeof(path), segmentActiveId, SEGMENT_SUFFIX_CURSOR);
+    rename(legacyCursorPath, path);
+
+    segmentPath(path, sizeof(path), segmentActiveId, SEGMENT_SUFFIX_LOG);
+
+    if(rename(legacyPath, path) == 0) {
+        LOG(LOG_INFO, "moved %s to segment %llu", legacyPath, segmentActiveId);
+        segmentManifestAppend(segmentActiveId++);
+    }
+}
+
+/**
+ * rebuild the manifest from the names in the segment directory - no segment is opened. Every segment found
+ * is treated as sealed, and the writer starts a new one
+ */
+int segmentManifestLoad(void)
+{
+    struct dirent * entry;
+    unsigned long long id;
+    char path[300];
+    char * end;
+    DIR * directory;
+
+    fileCreateDirectories(segmentDirectory);
+    mkdir(segmentDirectory, 0755);
+
+    directory = opendir(segmentDirectory);
+
+    if(directory == NULL) {
+        LOG(LOG_ERROR, "Failed to open %s: %s", segmentDirectory, strerror(errno));
+        return -1;
+    }
+
+    segmentManifestCount = 0;
+
+    while((entry = readdir(directory)) != NULL) {
+        errno = 0;
+        id = strtoull(entry->d_name, &end, 10);
+
+        if(end == entry->d_name || errno != 0 || strcmp(end, SEGMENT_SUFFIX_LOG) != 0) {
+            continue;
+        }
+
+        if(segmentManifestAppend(id) < 0) {
+            closedir(directory);
+            return -1;
+        }
+    }
+
+    closedir(directory);
+
+    qsort(segmentManifest, segmentManifestCount, sizeof(segmentManifest[0]), segmentCompare);
+
+    segmentActiveId = segmentManifestCount > 0 ? segmentManifest[segmentManifestCount - 1] + 1 : 1;
+
+    // count files from older versions are sent first
+    segmentAdoptLegacyFile("count.swp");
+    segmentAdoptLegacyFile("count");
+
+    // only the newest segment was being written to when the power went, so only its tail can be torn
+    if(segmentManifestCount > 0) {
+        segmentPath(path, sizeof(path), segmentManifest[segmentManifestCount - 1], SEGMENT_SUFFIX_LOG);
+        fileRepairCountFile(path);
+    }
+
+    LOG(LOG_INFO, "found %d segment(s) waiting to be uploaded", segmentManifestCount);
+
+    return 0;
+}
+
+/**
+ * choose the segment to upload next - the oldest sealed one. Once everything sealed has been sent, the active
+ * segment goes up to what has been committed to it, without sealing it, and committed is set to that length
+ * (-1 for a sealed segment). What hasn't been committed yet is left to the commit policy.
+ * Returns -1 if there is nothing to upload
+ */
+int segmentNextForUpload(unsigned long long * id, long long * committed)
+{
+    int returnValue = -1;
+
+    pthread_mutex_lock(&countFileMutex);
+
+    if(segmentManifestCount == 0) {
+        segmentSealIfDue();
+    }
+
+    * committed = -1;
+
+    if(segmentManifestCount > 0) {
+        * id = segmentManifest[0];
+        segmentUploadingId = * id;
+        returnValue = 0;
+    }
+    else if(countFileFd >= 0 && storageMode == STORAGE_SEGMENTS) {
+        * id = segmentActiveId;
+        * committed = segmentActiveSize;
+        segmentUploadingId = * id;
+        returnValue = 0;
+    }
+
+    pthread_mutex_unlock(&countFileMutex);
+
+    return returnValue;
+}
+
+/**
+ * a segment has been uploaded (or rejected by the endpoint) - delete it (or move it aside)
+ */
+void segmentUploaded(unsigned long long id, bool rejected)
+{
+    pthread_mutex_lock(&countFileMutex);
+
+    // a rejected active segment is sealed first, so the writer moves on to a new one
+    if(id == segmentActiveId) {
+        segmentSealActive();
+    }
+
+    segmentDelete(id, rejected);
+    segmentUploadingId = 0;
+
+    pthread_mutex_unlock(&countFileMutex);
+}
+
+int segmentPendingCount(void)
+{
+    int count;
+
+    pthread_mutex_lock(&countFileMutex);
+    count = segmentManifestCount;
+    pthread_mutex_unlock(&countFileMutex);
+
+    return count;
+}
+
+/**
+ * read a whole (small) file into memory
+ *
+ */
+char * fileGetFileContents(char * filename)
+{
+    char * fileContents;
+    unsigned long fileSize;
+    unsigned int bytesRead;
+    FILE * fileHandle;
+
+    fileHandle = fopen(filename, "rb");
+
+    // move file pointer to the end of the file
+    fseek(fileHandle, 0, SEEK_END);
+
+    // the position of the file pointer now
+    fileSize = ftell(fileHandle);
+
+    // move the pointer back to the start of the file
+    rewind(fileHandle);
+
+    // allocate memory, include an extra byte for null terminate char
+    fileContents = memAlloc(fileSize + 1);
+
+    // load the contents of the file into the fileContents var
+    bytesRead = fread(fileContents, 1, fileSize, fileHandle);
+
+    fclose(fileHandle);
+
+    // null terminate
+    // @gotcha - null terminate at bytes read, not fileSize bytes. For non-real (OS) files,
+    // a block (4096bytes) is returned
+    fileContents[bytesRead] = 0;
+
+    return fileContents;
+}
+
+char * fileGetMacAddress(void)
+{
+    return fileGetFileContents(PATH_MAC_ADDRESS_ETH0);
+}
+
+/**
+ * true if a byte can go into a URL encoded body as it is, as with curl_easy_escape
+ */
+static inline bool urlIsUnreserved(unsigned char c)
+{
+    return (c >= '0' && c <= '9')
+        || (c >= 'a' && c <= 'z')
+        || (c >= 'A' && c <= 'Z')
+        || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/**
+ * how many bytes a byte of CSV takes up in the POST body - URL encoded in a form, as it is with --body csv
+ */
+static inline int uploadBodyByteLength(unsigned char c)
+{
+    return uploadBodyMode != UPLOAD_BODY_FORM || urlIsUnreserved(c) ? 1 : 3;
+}
+
+/**
+ * URL encode length bytes of input into output a byte at a time. output must have room for 3 * length bytes.
+ * Returns the number of bytes written
+ */
+size_t urlEncodeScalar(const char * input, size_t length, char * output)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char * p = output;
+    size_t i;
+    unsigned char c;
+
+    for(i = 0; i < length; i++) {
+        c = input[i];
+
+        if(urlIsUnreserved(c)) {
+            * p++ = c;
+        }
+        else {
+            * p++ = '%';
+            * p++ = hex[c >> 4];
+            * p++ = hex[c & 0x0f];
+        }
+    }
+
+    return p - output;
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+/**
+ * which of the 16 bytes at input need escaping, URL_ESCAPE_BITS bits a byte with the first byte lowest
+ */
+#if defined(__SSE2__)
+#define URL_ESCAPE_BITS 1
+
+static inline uint64_t urlEscapeMask(const char * input)
+{
+    __m128i c = _mm_loadu_si128((const __m128i *) input);
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i unreserved;
+
+    // SSE2 only compares signed bytes, so each range is moved down to start at -128
+    unreserved = _mm_cmplt_epi8(_mm_add_epi8(c, _mm_set1_epi8((char) (0x80 - '0'))), _mm_set1_epi8((char) (0x80 + 10)));
+    unreserved = _mm_or_si128(unreserved, _mm_cmplt_epi8(_mm_add_epi8(lower, _mm_set1_epi8((char) (0x80 - 'a'))), _mm_set1_epi8((char) (0x80 + 26))));
+    unreserved = _mm_or_si128(unreserved, _mm_cmpeq_epi8(c, _mm_set1_epi8('-')));
+    unreserved = _mm_or_si128(unreserved, _mm_cmpeq_epi8(c, _mm_set1_epi8('.')));
+    unreserved = _mm_or_si128(unreserved, _mm_cmpeq_epi8(c, _mm_set1_epi8('_')));
+    unreserved = _mm_or_si128(unreserved, _mm_cmpeq_epi8(c, _mm_set1_epi8('~')));
+
+    return ~_mm_movemask_epi8(unreserved) & 0xffff;
+}
+#else
+#define URL_ESCAPE_BITS 4
+
+static inline uint64_t urlEscapeMask(const char * input)
+{
+    uint8x16_t c = vld1q_u8((const uint8_t *) input);
+    uint8x16_t unreserved;
+
+    unreserved = vcltq_u8(vsubq_u8(c, vdupq_n_u8('0')), vdupq_n_u8(10));
+    unreserved = vorrq_u8(unreserved, vcltq_u8(vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a')), vdupq_n_u8(26)));
+    unreserved = vorrq_u8(unreserved, vceqq_u8(c, vdupq_n_u8('-')));
+    unreserved = vorrq_u8(unreserved, vceqq_u8(c, vdupq_n_u8('.')));
+    unreserved = vorrq_u8(unreserved, vceqq_u8(c, vdupq_n_u8('_')));
+    unreserved = vorrq_u8(unreserved, vceqq_u8(c, vdupq_n_u8('~')));
+
+    // NEON has no movemask - narrowing each 16 bit lane by 4 leaves 4 bits a byte
+    return ~vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(unreserved), 4)), 0);
+}
+#endif
+
+#endif
+
+/**
+ * URL encode length bytes of input into output, which must have room for 3 * length + URL_ENCODE_SLACK bytes.
+ * 16 bytes are checked at a time - a count CSV has only a newline or two in each 16 bytes to escape, and the runs
+ * of digits between them are copied 16 bytes at a time. Returns the number of bytes written
+ */
+size_t urlEncode(const char * input, size_t length, char * output)
+{
+    char * p = output;
+    size_t i = 0;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    static const char hex[] = "0123456789ABCDEF";
+    // room to copy 16 bytes from anywhere in the block
+    char block[32] = { 0 };
+    uint64_t mask;
+    unsigned int start;
+    unsigned int escaped;
+    unsigned char c;
+
+    for(; i + 16 <= length; i += 16) {
+        mask = urlEscapeMask(input + i);
+
+        if(mask == 0) {
+            memcpy(p, input + i, 16);
+            p += 16;
+            continue;
+        }
+
+        memcpy(block, input + i, 16);
+        start = 0;
+
+        // copy the run up to each byte to escape, then escape it. The copies write past the run, into where the
+        // escape and the next run go
+        while(mask != 0) {
+            escaped = __builtin_ctzll(mask) / URL_ESCAPE_BITS;
+            mask &= ~((((uint64_t) 1 << URL_ESCAPE_BITS) - 1) << (escaped * URL_ESCAPE_BITS));
+
+            memcpy(p, block + start, 16);
+            p += escaped - start;
+
+            c = block[escaped];
+            p[0] = '%';
+            p[1] = hex[c >> 4];
+            p[2] = hex[c & 0x0f];
+            p += 3;
+
+            start = escaped + 1;
+        }
+
+        memcpy(p, block + start, 16);
+        p += 16 - start;
+    }
+#endif
+
+    return (p - output) + urlEncodeScalar(input + i, length - i, p);
+}
+
+/**
+ * put length bytes of CSV into output as the body has them - URL encoded, or copied as they are with --body csv or
+ * once converted to the binary wire format. output must have room for 3 * length + URL_ENCODE_SLACK bytes.
+ * Returns the number of bytes written
+ */
+size_t uploadBodyEncode(const char * input, size_t length, char * output)
+{
+    if(uploadBodyMode != UPLOAD_BODY_FORM) {
+        memcpy(output, input, length);
+        return length;
+    }
+
+    return urlEncode(input, length, output);
+}
+
+/**
+ * length of a hit's CSV line once in the body
+ */
+long long countRecordEncodedLength(const struct countRecord * record)
+{
+    char line[64];
+    long long encodedLength = 0;
+    int lineLength;
+    int i;
+
+    lineLength = countRecordToCsv(record, line, sizeof(line));
+
+    for(i = 0; i < lineLength; i++) {
+        encodedLength += uploadBodyByteLength(line[i]);
+    }
+
+    return encodedLength;
+}
+
+/**
+ * read the acknowledged byte offset into a segment. 0 if nothing has been acknowledged yet
+ */
+long long fileGetSegmentCursor(unsigned long long id)
+{
+    char path[300];
+    char buffer[32];
+    long long offset;
+    ssize_t bytesRead;
+    int fd;
+
+    segmentPath(path, sizeof(path), id, SEGMENT_SUFFIX_CURSOR);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) {
+        return 0;
+    }
+
+    bytesRead = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+
+    if(bytesRead <= 0) {
+        return 0;
+    }
+
+    buffer[bytesRead] = 0;
+    offset = strtoll(buffer, NULL, 10);
+
+    return offset > 0 ? offset : 0;
+}
+
+/**
+ * save the acknowledged byte offset into a segment. Written to a temporary file, synced and renamed
+ * over the old cursor, so a power cut leaves either the old or the new offset
+ */
+int fileSetSegmentCursor(unsigned long long id, long long offset)
+{
+    char path[300];
+    char temporaryPath[sizeof(path) + 8];
+    char buffer[32];
+    int length;
+    int fd;
+
+    segmentPath(path, sizeof(path), id, SEGMENT_SUFFIX_CURSOR);
+    snprintf(temporaryPath, sizeof(temporaryPath), "%s.tmp", path);
+
+    fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if(fd < 0) {
+        LOG(LOG_ERROR, "Failed to open cursor file: %s", strerror(errno));
+        return -1;
+    }
+
+    length = snprintf(buffer, sizeof(buffer), "%lld\n", offset);
+
+    if(write(fd, buffer, length) != length || fdatasync(fd) < 0) {
+        LOG(LOG_ERROR, "Failed to write cursor file: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return rename(temporaryPath, path);
+}
+
+/**
+ * how far through choosing a batch of CSV - see csvBatchScan()
+ */
+struct csvBatch {
+    long long length;
+    long long encoded;
+    long long lineEncoded;
+    long long lineStart;
+    long records;
+};
+
+/**
+ * add the next length bytes of CSV to a batch. Returns true once the batch is full - the line that didn't fit
+ * isn't part of it
+ */
+static bool csvBatchScan(struct csvBatch * batch, const char * csv, size_t length)
+{
+    size_t i;
+
+    for(i = 0; i < length; i++) {
+        batch->length++;
+        batch->lineEncoded += uploadBodyByteLength(csv[i]);
+
+        if(csv[i] != '\n') {
+            continue;
+        }
+
+        // a whole line - does it still fit in the batch?
+        if(batch->records > 0 && (batch->length > uploadBatchBytes || (uploadBatchRecords > 0 && batch->records >= uploadBatchRecords))) {
+            return true;
+        }
+
+        batch->records++;
+        batch->encoded += batch->lineEncoded;
+        batch->lineEncoded = 0;
+        batch->lineStart = batch->length;
+    }
+
+    return false;
+}
+
+/**
+ * the raw and encoded length of a batch once all of the CSV has been scanned, or it is full
+ */
+static void csvBatchFinish(struct csvBatch * batch, bool full, long long * batchLength, long long * encodedLength)
+{
+    // a torn last line (e.g. power cut mid write) still gets sent, rather than blocking the file forever
+    if(!full && (batch->records == 0 || batch->length <= uploadBatchBytes)) {
+        batch->encoded += batch->lineEncoded;
+        batch->lineStart = batch->length;
+    }
+
+    * batchLength = batch->lineStart;
+    * encodedLength = batch->encoded;
+}
+
+/**
+ * choose the next batch of the swap file to upload, from offset up to end. A batch ends on a line boundary and
+ * stays within uploadBatchBytes / uploadBatchRecords, unless a single line is bigger than that.
+ * Sets the raw and URL encoded length of the batch. Returns -1 if the file can't be read
+ */
+int fileSelectBatch(int fd, long long offset, long long end, char * buffer, size_t bufferSize, long long * batchLength, long long * encodedLength)
+{
+    struct csvBatch batch = { 0 };
+    bool full = false;
+    ssize_t bytesRead;
+    size_t chunk;
+
+    * batchLength = 0;
+    * encodedLength = 0;
+
+    if(lseek(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    while(!full && offset < end) {
+        chunk = end - offset < (long long) bufferSize ? (size_t)(end - offset) : bufferSize;
+
+        if((bytesRead = read(fd, buffer, chunk)) == 0) {
+            break;
+        }
+
+        if(bytesRead < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        full = csvBatchScan(&batch, buffer, bytesRead);
+        offset += bytesRead;
+    }
+
+    csvBatchFinish(&batch, full, batchLength, encodedLength);
+
+    return 0;
+}
+
+/**
+ * choose the next batch of a binary swap file to upload, starting at offset (which must be on a record boundary).
+ * As fileSelectBatch(), but the limits apply to the CSV the records are converted to. Records failing their
+ * CRC are skipped
+ */
+int fileSelectBinaryBatch(int fd, long long offset, long long end, char * buffer, size_t bufferSize, long long * batchLength, long long * encodedLength)
+{
+    struct countRecord * records = (struct countRecord *) buffer;
+    size_t recordsPerRead = bufferSize / sizeof(struct countRecord);
+    size_t chunk;
+    char line[64];
+    long long csvLength = 0;
+    long count = 0;
+    int lineLength;
+    ssize_t bytesRead;
+    size_t i;
+    size_t r;
+
+    * batchLength = 0;
+    * encodedLength = 0;
+
+    if(lseek(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    while(offset < end) {
+        chunk = end - offset < (long long)(recordsPerRead * sizeof(struct countRecord)) ? (size_t)(end - offset) : recordsPerRead * sizeof(struct countRecord);
+
+        if((bytesRead = fileReadFully(fd, records, chunk)) == 0) {
+            break;
+        }
+
+        if(bytesRead < 0) {
+            return -1;
+        }
+
+        offset += bytesRead;
+
+        for(r = 0; r < bytesRead / sizeof(struct countRecord); r++) {
+            if(!countRecordIsValid(&records[r])) {
+                * batchLength += sizeof(struct countRecord);
+                continue;
+            }
+
+            lineLength = countRecordToCsv(&records[r], line, sizeof(line));
+
+            // does it still fit in the batch?
+            if(count > 0 && (csvLength + lineLength > uploadBatchBytes || (uploadBatchRecords > 0 && count >= uploadBatchRecords))) {
+                return 0;
+            }
+
+            count++;
+            csvLength += lineLength;
+            * batchLength += sizeof(struct countRecord);
+
+            for(i = 0; i < (size_t) lineLength; i++) {
+                * encodedLength += uploadBodyByteLength(line[i]);
+            }
+        }
+
+        // a partial record at the end is a torn write - it is stepped over, and acknowledged with the batch
+        if(bytesRead % sizeof(struct countRecord) != 0) {
+            * batchLength += bytesRead % sizeof(struct countRecord);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * choose the next batch of a compressed count file to upload, starting at the block at offset and ending by end.
+ * A batch is whole blocks and stays within uploadBatchBytes / uploadBatchRecords of CSV, unless a single block is
+ * bigger than that. Sets the raw length of the batch and the length of its CSV once URL encoded. Returns -1 if
+ * the file can't be read
+ */
+int fileSelectCompressedBatch(int fd, long long offset, long long end, unsigned char * block, struct countRecord * records, long long * batchLength, long long * encodedLength)
+{
+    char line[64];
+    long long csvLength = 0;
+    long long blockCsvLength;
+    long long blockEncodedLength;
+    long count = 0;
+    int lineLength;
+    ssize_t blockSize;
+    off_t skipped;
+    int decoded;
+    int d;
+    int i;
+
+    * batchLength = 0;
+    * encodedLength = 0;
+
+    if(lseek(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    // anything that isn't a good block is stepped over, but still acknowledged with the batch
+    while((blockSize = fileReadCountBlock(fd, block, &skipped)) > 0) {
+        // a block being written after end isn't part of the batch yet
+        if(offset + * batchLength + skipped + blockSize > end) {
+            break;
+        }
+
+        blockCsvLength = 0;
+        blockEncodedLength = 0;
+
+        decoded = countBlockDecode(block, records);
+
+        for(d = 0; d < decoded; d++) {
+            lineLength = countRecordToCsv(&records[d], line, sizeof(line));
+            blockCsvLength += lineLength;
+
+            for(i = 0; i < lineLength; i++) {
+                blockEncodedLength += uploadBodyByteLength(line[i]);
+            }
+        }
+
+        // does it still fit in the batch?
+        if(count > 0 && (csvLength + blockCsvLength > uploadBatchBytes || (uploadBatchRecords > 0 && count + decoded > uploadBatchRecords))) {
+            break;
+        }
+
+        if(decoded > 0) {
+            count += decoded;
+        }
+        csvLength += blockCsvLength;
+        * batchLength += skipped + blockSize;
+        * encodedLength += blockEncodedLength;
+    }
+
+    if(blockSize < 0) {
+        return -1;
+    }
+
+    // nothing but a torn write after the last block
+    if(blockSize == 0 && offset + * batchLength + skipped <= end) {
+        * batchLength += skipped;
+    }
+
+    return 0;
+}
+
+/**
+ * choose the next batch of the ring to upload, from offset up to head, within uploadBatchBytes / uploadBatchRecords
+ * of CSV. Sets the length of the batch in the ring and of its CSV once URL encoded
+ */
+void ringSelectBatch(uint64_t offset, uint64_t head, long long * batchLength, long long * encodedLength)
+{
+    const struct countRecord * record;
+    char line[64];
+    long long csvLength = 0;
+    long count = 0;
+    int lineLength;
+    int i;
+
+    * batchLength = 0;
+    * encodedLength = 0;
+
+    for(; offset < head; offset += sizeof(struct countRecord)) {
+        record = (const struct countRecord *)(ringData + offset % ringCapacity);
+
+        if(!ringRecordIsValid(record, offset)) {
+            * batchLength += sizeof(struct countRecord);
+            continue;
+        }
+
+        lineLength = countRecordToCsv(record, line, sizeof(line));
+
+        // does it still fit in the batch?
+        if(count > 0 && (csvLength + lineLength > uploadBatchBytes || (uploadBatchRecords > 0 && count >= uploadBatchRecords))) {
+            return;
+        }
+
+        count++;
+        csvLength += lineLength;
+        * batchLength += sizeof(struct countRecord);
+
+        for(i = 0; i < lineLength; i++) {
+            * encodedLength += uploadBodyByteLength(line[i]);
+        }
+    }
+}
+
+/**
+ * choose the next batch of hits taken from the staging buffer, within uploadBatchBytes / uploadBatchRecords of
+ * CSV. Sets the length of the batch in bytes of records, and of its CSV once URL encoded
+ */
+void stagingSelectBatch(const struct countRecord * records, unsigned int count, long long * batchLength, long long * encodedLength)
+{
+    char line[64];
+    long long csvLength = 0;
+    unsigned int r;
+    int lineLength;
+    int i;
+
+    * batchLength = 0;
+    * encodedLength = 0;
+
+    for(r = 0; r < count; r++) {
+        lineLength = countRecordToCsv(&records[r], line, sizeof(line));
+
+        // does it still fit in the batch?
+        if(r > 0 && (csvLength + lineLength > uploadBatchBytes || (uploadBatchRecords > 0 && r >= (unsigned long) uploadBatchRecords))) {
+            return;
+        }
+
+        csvLength += lineLength;
+        * batchLength += sizeof(struct countRecord);
+
+        for(i = 0; i < lineLength; i++) {
+            * encodedLength += uploadBodyByteLength(line[i]);
+        }
+    }
+}
+
+/**
+ * where the batch being posted comes from
+ *
+ * UPLOAD_SOURCE_SEGMENT: a sealed segment file
+ * UPLOAD_SOURCE_RING: the ring file
+ * UPLOAD_SOURCE_STAGING: hits staged in RAM that haven't been flushed to the card
+ * UPLOAD_SOURCE_CACHE: a batch of a segment, taken from the hot tail cache rather than the segment file
+ */
+enum uploadSources { UPLOAD_SOURCE_SEGMENT, UPLOAD_SOURCE_RING, UPLOAD_SOURCE_STAGING, UPLOAD_SOURCE_CACHE };
+
+/**
+ * the URL encoded CSV of the last batch of a segment or the ring to be posted, kept until it is acknowledged so a
+ * retry is sent from memory instead of being read, converted and encoded again. It is only used once the whole
+ * batch has been encoded, and only for a batch starting at the same place in the same segment file - a segment
+ * that has been cut short or replaced since has a different size, inode or mtime. The ring is never rewritten
+ * ahead of the tail, so there the offset is enough. Only touched by the main thread
+ */
+struct uploadPayload {
+    enum uploadSources source;
+    unsigned long long segmentId;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    long long offset;
+    // the batch being encoded - how much of the segment or ring it covers, and its CSV once URL encoded
+    long long batchLength;
+    long long encodedLength;
+    // how it was encoded - the body mode, the format the hits were read in (binary for cached hits, whatever the
+    // segment's format) and, for the binary wire format, the columns and time unit that go in its header
+    enum uploadBodyModes bodyMode;
+    enum countFormats format;
+    unsigned char wireFlags;
+    uint64_t wireTimeUnitUs;
+    // what has been encoded so far, complete once length reaches encodedLength
+    char * encoded;
+    size_t capacity;
+    size_t length;
+};
+
+static atomic_ullong payloadReusedCount;
+static atomic_ullong payloadReusedBytes;
+
+/**
+ * the POST body, URL encoded from a batch of the swap file as curl asks for it
+ */
+struct uploadBody {
+    enum uploadSources source;
+    // the segment, the offset into the ring, or how far through the records in memory the body has got
+    int fd;
+    // a CSV segment sent as it is with --body csv, handed to curl straight from the mapping
+    char * map;
+    size_t mapLength;
+    uint64_t ringOffset;
+    size_t recordsOffset;
+    // binary and compressed files are converted to CSV as they are read
+    enum countFormats format;
+    // bytes of the batch still to be read from the file
+    long long remaining;
+    // "macAddress=...&csv=", sent before the file
+    char prefix[128];
+    size_t prefixLength;
+    size_t prefixSent;
+    // raw bytes read from the file, the CSV they convert to if the file is binary, and the encoded bytes
+    // waiting to be handed to curl
+    char raw[UPLOAD_READ_BUFFER_SIZE];
+    char csv[UPLOAD_READ_BUFFER_SIZE * 2];
+    char encoded[UPLOAD_READ_BUFFER_SIZE * 6 + URL_ENCODE_SLACK];
+    size_t encodedLength;
+    size_t encodedSent;
+    // the compressed block being sent, decoded, and how many of its hits have been converted to CSV
+    unsigned char block[COUNT_BLOCK_MAX_SIZE];
+    struct countRecord blockRecords[COUNT_BUFFER_RECORDS];
+    int blockRecordCount;
+    int blockRecordsConverted;
+    // hits taken from the staging buffer or the hot tail cache, to be sent straight from RAM, and for the cache
+    // where each ends in its segment
+    struct countRecord records[STAGING_UPLOAD_RECORDS];
+    long long recordEnds[STAGING_UPLOAD_RECORDS];
+    unsigned int recordCount;
+    // with --compress, whether this batch is being compressed and whether the compressed stream has all gone, the
+    // streams (set up once, and reset for each batch) and the uncompressed body waiting to go into them
+    bool compressing;
+    bool compressFinished;
+    z_stream gzip;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx * zstd;
+#endif
+    char plain[UPLOAD_READ_BUFFER_SIZE];
+    size_t plainLength;
+    size_t plainUsed;
+    bool plainFinished;
+    // with --body binary, the columns sent and the time unit for this batch, the time of the last hit converted, and
+    // a CSV line carried over from the last read
+    unsigned char wireFlags;
+    uint64_t wireTimeUnitUs;
+    uint64_t wirePreviousTime;
+    char line[32];
+    size_t lineLength;
+    // the encoded CSV kept from an earlier attempt at this batch, sent before anything is read, and whether what is
+    // encoded from here on is being added to it
+    struct uploadPayload * payload;
+    size_t payloadLength;
+    size_t payloadSent;
+    bool payloadKeep;
+};
+
+/**
+ * choose the next batch of a segment from the hot tail cache, copying its hits into the body so it is posted
+ * without reading the segment back. A batch stays within uploadBatchBytes / uploadBatchRecords of CSV and ends
+ * where a hit ends in the segment - on a line, record or block boundary. Sets the length of the batch in the
+ * segment and of its CSV once URL encoded. Returns -1 if the hits at offset aren't cached
+ */
+int cacheSelectBatch(unsigned long long segmentId, long long offset, struct uploadBody * body, long long * batchLength, long long * encodedLength)
+{
+    const struct cacheEntry * entry;
+    long long recordsLength;
+    unsigned int count = 0;
+    unsigned int selected;
+    unsigned int r;
+    int first;
+
+    if(cacheSize == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&countFileMutex);
+
+    first = cacheFind(segmentId, offset);
+
+    while(first >= 0 && (unsigned int) first + count < cacheCount && count < STAGING_UPLOAD_RECORDS) {
+        entry = &cacheEntries[(cacheFirst + first + count) % cacheSize];
+
+        if(entry->segmentId != segmentId) {
+            break;
+        }
+
+        body->records[count] = entry->record;
+        body->recordEnds[count] = entry->end;
+        count++;
+    }
+
+    pthread_mutex_unlock(&countFileMutex);
+
+    if(count == 0) {
+        atomic_fetch_add_explicit(&cacheMissCount, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    stagingSelectBatch(body->records, count, &recordsLength, encodedLength);
+    selected = recordsLength / sizeof(struct countRecord);
+
+    // don't split the hits of a compressed block - back up to the start of the block, or if the first block
+    // is bigger than a batch on its own, send all of it
+    while(selected > 0 && selected < count && body->recordEnds[selected] == body->recordEnds[selected - 1]) {
+        selected--;
+    }
+
+    if(selected == 0) {
+        for(selected = 1; selected < count && body->recordEnds[selected] == body->recordEnds[0]; selected++);
+    }
+
+    if(selected * sizeof(struct countRecord) != (unsigned long long) recordsLength) {
+        * encodedLength = 0;
+        for(r = 0; r < selected; r++) {
+            * encodedLength += countRecordEncodedLength(&body->records[r]);
+        }
+    }
+
+    body->recordCount = selected;
+    * batchLength = body->recordEnds[selected - 1] - offset;
+
+    atomic_fetch_add_explicit(&cacheHitCount, 1, memory_order_relaxed);
+
+    return 0;
+}
+
+/**
+ * where the uploads are
+ *
+ * UPLOAD_IDLE: nothing in flight, checking for a count file to send
+ * UPLOAD_IN_FLIGHT: a batch is being posted
+ * UPLOAD_BACKOFF: the last batch or probe failed, waiting before trying again
+ * UPLOAD_PROBING: the circuit breaker is open, and a probe is checking whether the endpoint is back
+ */
+enum uploadStates { UPLOAD_IDLE, UPLOAD_IN_FLIGHT, UPLOAD_BACKOFF, UPLOAD_PROBING };
+
+/**
+ * long lived curl state, so the connection (and its DNS lookup and TLS session) is reused between uploads,
+ * and where the uploads are up to
+ */
+struct uploadContext {
+    CURL * curl;
+    // HEAD request used to probe the endpoint while the circuit breaker is open
+    CURL * probeCurl;
+    CURLM * multi;
+    struct curl_slist * headers;
+    // with --body csv or binary, the headers saying so, set up once the MAC address has been read. The binary
+    // format carries the MAC address as 6 bytes
+    struct curl_slist * bodyHeaders;
+    unsigned char deviceId[6];
+    // the headers in use, with the Content-Encoding added, for compressed bodies
+    struct curl_slist * compressedHeaders;
+    struct curl_slist * compressedHeadersBase;
+    struct uploadBody * body;
+    // read by the main loop for the stats
+    atomic_int state;
+    char macAddress[64];
+    // where the batch comes from
+    enum uploadSources source;
+    // the segment being uploaded, its format and size, how much of it has been acknowledged, and the size of
+    // the batch in flight
+    unsigned long long segmentId;
+    enum countFormats segmentFormat;
+    long long segmentSize;
+    struct stat segmentStat;
+    // the segment is still being written to, so segmentSize is what had been committed when it was chosen
+    bool segmentActive;
+    long long offset;
+    long long batchLength;
+    // the encoded batch kept for retries
+    struct uploadPayload payload;
+    // when to leave UPLOAD_BACKOFF, CLOCK_MONOTONIC
+    unsigned long long backoffUntilUs;
+    // when the last batch was started, CLOCK_MONOTONIC, and whether new hits are being held back for a fuller one
+    unsigned long long lastPostUs;
+    bool holding;
+    // failed batches or probes since the last success. Only touched by the main thread
+    unsigned int consecutiveFailures;
+    // while open, no batches are sent until a probe gets an answer
+    bool breakerOpen;
+};
+
+static struct uploadContext uploadContext;
+
+/**
+ * the start of a binary body: WIRE_MAGIC, the WIRE_VERSION and flags bytes, the time unit in µs as a varint, then
+ * the device id (the MAC address) as 6 bytes. Returns the length written, at most 21
+ */
+size_t wireHeaderEncode(const struct uploadBody * body, const unsigned char * deviceId, unsigned char * output)
+{
+    size_t length = 0;
+
+    memcpy(output, WIRE_MAGIC, 4);
+    length += 4;
+    output[length++] = WIRE_VERSION;
+    output[length++] = body->wireFlags;
+    length += varintEncode(body->wireTimeUnitUs, output + length);
+    memcpy(output + length, deviceId, 6);
+    length += 6;
+
+    return length;
+}
+
+/**
+ * encode a hit in the binary wire format: the change in time since the last hit in the body (the time itself for
+ * the first) as a zigzag varint, then the pulse width and channel as varints if the body has those columns.
+ * Times are in the body's time unit - seconds for hits from CSV, otherwise µs. Returns the number of bytes written,
+ * at most 18
+ */
+size_t wireRecordEncode(struct uploadBody * body, const struct countRecord * record, unsigned char * output)
+{
+    uint64_t time = record->timeUs / body->wireTimeUnitUs;
+    size_t length;
+
+    length = varintEncode(zigzagEncode((int64_t) (time - body->wirePreviousTime)), output);
+    body->wirePreviousTime = time;
+
+    if(body->wireFlags & WIRE_FLAG_PULSE_WIDTHS) {
+        length += varintEncode(record->pulseWidthUs, output + length);
+    }
+
+    if(body->wireFlags & WIRE_FLAG_CHANNELS) {
+        length += varintEncode(record->channel, output + length);
+    }
+
+    return length;
+}
+
+/**
+ * estimate how long a binary body will be from the length of the same hits as CSV, as the binary body's length
+ * isn't known until it has all been encoded. A CSV line is at least 11 bytes ("1792147987\n", and ",N" with
+ * channels), and a hit a few seconds after the last one takes 4 bytes of µs (1 of seconds), 3 of pulse width
+ * and 1 of channel
+ */
+long long wireBodyLengthEstimate(const struct uploadBody * body, long long csvLength)
+{
+    long long hits = csvLength / (body->wireFlags & WIRE_FLAG_CHANNELS ? 13 : 11);
+    long long hitLength = body->wireTimeUnitUs == 1 ? 4 : 1;
+
+    if(body->wireFlags & WIRE_FLAG_PULSE_WIDTHS) {
+        hitLength += 3;
+    }
+
+    if(body->wireFlags & WIRE_FLAG_CHANNELS) {
+        hitLength += 1;
+    }
+
+    return body->prefixLength + hits * hitLength;
+}
+
+/**
+ * a hit as it goes in the body - a CSV line, or encoded in the binary wire format. Returns the length written
+ */
+static size_t uploadBodyConvertRecord(struct uploadBody * body, const struct countRecord * record, char * output, size_t outputSize)
+{
+    if(uploadBodyMode == UPLOAD_BODY_BINARY) {
+        return wireRecordEncode(body, record, (unsigned char *) output);
+    }
+
+    return countRecordToCsv(record, output, outputSize);
+}
+
+/**
+ * convert the CSV read into raw to the binary wire format, carrying a line cut short by the end of the read over
+ * to the next. A torn last line at the end of the batch is sent as it is. Returns the length written to body->csv
+ */
+static size_t uploadBodyConvertCsv(struct uploadBody * body, size_t rawLength)
+{
+    struct countRecord record = { 0 };
+    unsigned long long seconds;
+    size_t wireLength = 0;
+    size_t i;
+    char * end;
+
+    for(i = 0; i < rawLength; i++) {
+        if(body->raw[i] != '\n' && body->lineLength < sizeof(body->line) - 1) {
+            body->line[body->lineLength++] = body->raw[i];
+        }
+
+        // the end of a line, or of the batch
+        if(body->raw[i] != '\n' && (i < rawLength - 1 || body->remaining > 0)) {
+            continue;
+        }
+
+        body->line[body->lineLength] = 0;
+        body->lineLength = 0;
+
+        seconds = strtoull(body->line, &end, 10);
+
+        // not a hit - there's nothing to send
+        if(end == body->line) {
+            continue;
+        }
+
+        record.timeUs = seconds * 1000000;
+        record.channel = * end == ',' ? strtoul(end + 1, NULL, 10) : 0;
+
+        wireLength += wireRecordEncode(body, &record, (unsigned char *) body->csv + wireLength);
+    }
+
+    return wireLength;
+}
+
+/**
+ * convert the binary records read into raw to CSV, skipping any failing their CRC. Returns the length of the CSV
+ */
+static size_t uploadBodyConvertRecords(struct uploadBody * body, size_t rawLength)
+{
+    const struct countRecord * records = (const struct countRecord *) body->raw;
+    // records from the ring are checked against where they were read from - ringOffset is already past them
+    uint64_t ringOffset = body->ringOffset - rawLength;
+    size_t csvLength = 0;
+    size_t i;
+
+    for(i = 0; i < rawLength / sizeof(struct countRecord); i++) {
+        if(body->source == UPLOAD_SOURCE_RING ? ringRecordIsValid(&records[i], ringOffset + i * sizeof(struct countRecord)) : countRecordIsValid(&records[i])) {
+            csvLength += uploadBodyConvertRecord(body, &records[i], body->csv + csvLength, sizeof(body->csv) - csvLength);
+        }
+    }
+
+    return csvLength;
+}
+
+/**
+ * add what has just been encoded to the kept payload, giving up on keeping it if it has outgrown the buffer
+ */
+static void uploadBodyKeepEncoded(struct uploadBody * body)
+{
+    struct uploadPayload * payload = body->payload;
+
+    if(!body->payloadKeep) {
+        return;
+    }
+
+    if(payload->length + body->encodedLength > payload->capacity) {
+        body->payloadKeep = false;
+        payload->length = 0;
+        return;
+    }
+
+    memcpy(payload->encoded + payload->length, body->encoded, body->encodedLength);
+    payload->length += body->encodedLength;
+}
+
+/**
+ * the whole batch has been handed to curl. Without a length known up front (the binary wire format), this is when
+ * the kept payload is known to be complete
+ */
+static void uploadBodyFinished(struct uploadBody * body)
+{
+    if(body->payloadKeep && body->payload->encodedLength < 0) {
+        body->payload->encodedLength = body->payload->length;
+    }
+}
+
+/**
+ * convert as many of the decoded block's hits as fit in body->csv, reading the next block once they have all gone.
+ * Returns the CSV length, 0 at the end of the batch or -1 if the file can't be read
+ */
+static ssize_t uploadBodyConvertBlock(struct uploadBody * body)
+{
+    size_t csvLength = 0;
+    ssize_t blockSize;
+    off_t skipped;
+
+    while(body->blockRecordsConverted == body->blockRecordCount) {
+        if(body->remaining == 0) {
+            return 0;
+        }
+
+        blockSize = fileReadCountBlock(body->fd, body->block, &skipped);
+
+        // the batch can end with a torn write, which was stepped over
+        if(blockSize == 0 && skipped == body->remaining) {
+            body->remaining = 0;
+            return 0;
+        }
+
+        if(blockSize <= 0 || skipped + blockSize > body->remaining) {
+            // a read error, or the file has changed since the batch was chosen
+            return -1;
+        }
+
+        body->remaining -= skipped + blockSize;
+        body->blockRecordCount = countBlockDecode(body->block, body->blockRecords);
+        body->blockRecordsConverted = 0;
+
+        // a corrupt block has nothing to send
+        if(body->blockRecordCount < 0) {
+            body->blockRecordCount = 0;
+        }
+    }
+
+    // leave room for the longest line
+    while(body->blockRecordsConverted < body->blockRecordCount && csvLength + 64 <= sizeof(body->csv)) {
+        csvLength += uploadBodyConvertRecord(body, &body->blockRecords[body->blockRecordsConverted++], body->csv + csvLength, sizeof(body->csv) - csvLength);
+    }
+
+    return csvLength;
+}
+
+/**
+ * hand curl the prefix, then whatever was kept of the batch, then the rest of the batch, URL encoding a buffer at
+ * a time. Has the same contract as a CURLOPT_READFUNCTION
+ */
+static size_t uploadBodyReadPlain(char * buffer, size_t size, size_t nitems, void * userdata)
+{
+    struct uploadBody * body = userdata;
+    size_t bufferSize = size * nitems;
+    size_t copied = 0;
+    size_t chunk;
+    ssize_t bytesRead;
+
+    while(copied < bufferSize) {
+        if(body->prefixSent < body->prefixLength) {
+            chunk = body->prefixLength - body->prefixSent;
+            if(chunk > bufferSize - copied) {
+                chunk = bufferSize - copied;
+            }
+            memcpy(buffer + copied, body->prefix + body->prefixSent, chunk);
+            body->prefixSent += chunk;
+            copied += chunk;
+            continue;
+        }
+
+        if(body->payloadSent < body->payloadLength) {
+            chunk = body->payloadLength - body->payloadSent;
+            if(chunk > bufferSize - copied) {
+                chunk = bufferSize - copied;
+            }
+            memcpy(buffer + copied, body->payload->encoded + body->payloadSent, chunk);
+            body->payloadSent += chunk;
+            copied += chunk;
+            continue;
+        }
+
+        // refill from the file once everything encoded has gone
+        if(body->encodedSent == body->encodedLength && body->format == COUNT_FORMAT_COMPRESSED) {
+            bytesRead = uploadBodyConvertBlock(body);
+
+            if(bytesRead < 0) {
+                return CURL_READFUNC_ABORT;
+            }
+
+            if(bytesRead == 0) {
+                // end of the batch
+                uploadBodyFinished(body);
+                break;
+            }
+
+            body->encodedLength = uploadBodyEncode(body->csv, bytesRead, body->encoded);
+            body->encodedSent = 0;
+            uploadBodyKeepEncoded(body);
+        }
+        else if(body->encodedSent == body->encodedLength) {
+            chunk = sizeof(body->raw);
+            if(body->format == COUNT_FORMAT_BINARY) {
+                // whole records only
+                chunk -= chunk % sizeof(struct countRecord);
+            }
+            else if(uploadBodyMode == UPLOAD_BODY_BINARY) {
+                // a hit takes up to 18 bytes once encoded, and a CSV line can be as short as 2
+                chunk = sizeof(body->csv) / 9;
+            }
+            if((long long) chunk > body->remaining) {
+                chunk = body->remaining;
+            }
+
+            if(chunk == 0) {
+                // end of the batch
+                uploadBodyFinished(body);
+                break;
+            }
+
+            if(body->source == UPLOAD_SOURCE_RING) {
+                bytesRead = ringRead(&body->ringOffset, body->raw, chunk);
+            }
+            else if(body->source == UPLOAD_SOURCE_STAGING || body->source == UPLOAD_SOURCE_CACHE) {
+                memcpy(body->raw, (const char *) body->records + body->recordsOffset, chunk);
+                body->recordsOffset += chunk;
+                bytesRead = chunk;
+            }
+            else {
+                bytesRead = fileReadFully(body->fd, body->raw, chunk);
+            }
+
+            if(bytesRead <= 0) {
+                // a read error, or the file is shorter than when the batch was chosen
+                return CURL_READFUNC_ABORT;
+            }
+
+            body->remaining -= bytesRead;
+
+            if(body->format == COUNT_FORMAT_BINARY) {
+                body->encodedLength = uploadBodyEncode(body->csv, uploadBodyConvertRecords(body, bytesRead), body->encoded);
+            }
+            else if(uploadBodyMode == UPLOAD_BODY_BINARY) {
+                body->encodedLength = uploadBodyEncode(body->csv, uploadBodyConvertCsv(body, bytesRead), body->encoded);
+            }
+            else {
+                body->encodedLength = uploadBodyEncode(body->raw, bytesRead, body->encoded);
+            }
+            body->encodedSent = 0;
+            uploadBodyKeepEncoded(body);
+        }
+
+        chunk = body->encodedLength - body->encodedSent;
+        if(chunk > bufferSize - copied) {
+            chunk = bufferSize - copied;
+        }
+        memcpy(buffer + copied, body->encoded + body->encodedSent, chunk);
+        body->encodedSent += chunk;
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+/**
+ * compress what is waiting in body->plain into output, finishing the stream once the plain body has all gone.
+ * Returns the number of bytes written, or -1 if the compressor fails
+ */
+static ssize_t uploadBodyCompress(struct uploadBody * body, char * output, size_t outputSize)
+{
+    int result;
+#ifdef HAVE_ZSTD
+    ZSTD_inBuffer in = { body->plain, body->plainLength, body->plainUsed };
+    ZSTD_outBuffer out = { output, outputSize, 0 };
+    size_t remaining;
+
+    if(uploadCompression == UPLOAD_COMPRESS_ZSTD) {
+        remaining = ZSTD_compressStream2(body->zstd, &out, &in, body->plainFinished ? ZSTD_e_end : ZSTD_e_continue);
+
+        if(ZSTD_isError(remaining)) {
+            LOG(LOG_WARNING, "upload failed: %s", ZSTD_getErrorName(remaining));
+            return -1;
+        }
+
+        body->plainUsed = in.pos;
+        body->compressFinished = body->plainFinished && remaining == 0;
+
+        return out.pos;
+    }
+#endif
+
+    body->gzip.next_in = (Bytef *) body->plain + body->plainUsed;
+    body->gzip.avail_in = body->plainLength - body->plainUsed;
+    body->gzip.next_out = (Bytef *) output;
+    body->gzip.avail_out = outputSize;
+
+    result = deflate(&body->gzip, body->plainFinished ? Z_FINISH : Z_NO_FLUSH);
+
+    // Z_BUF_ERROR just means it needs more of the plain body
+    if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+        LOG(LOG_WARNING, "upload failed: deflate returned %d", result);
+        return -1;
+    }
+
+    body->plainUsed = body->plainLength - body->gzip.avail_in;
+    body->compressFinished = result == Z_STREAM_END;
+
+    return outputSize - body->gzip.avail_out;
+}
+
+/**
+ * CURLOPT_READFUNCTION - hand curl the body, through the compressor if this batch is being compressed
+ */
+static size_t uploadBodyRead(char * buffer, size_t size, size_t nitems, void * userdata)
+{
+    struct uploadBody * body = userdata;
+    unsigned long long startUs = getMonotonicMicroseconds();
+    size_t plainLength;
+    ssize_t compressed = 0;
+
+    if(!body->compressing) {
+        return uploadBodyReadPlain(buffer, size, nitems, userdata);
+    }
+
+    while(compressed == 0 && !body->compressFinished) {
+        if(body->plainUsed == body->plainLength && !body->plainFinished) {
+            plainLength = uploadBodyReadPlain(body->plain, 1, sizeof(body->plain), body);
+
+            if(plainLength == CURL_READFUNC_ABORT) {
+                return CURL_READFUNC_ABORT;
+            }
+
+            body->plainLength = plainLength;
+            body->plainUsed = 0;
+            body->plainFinished = plainLength == 0;
+            atomic_fetch_add_explicit(&compressBytesIn, plainLength, memory_order_relaxed);
+        }
+
+        compressed = uploadBodyCompress(body, buffer, size * nitems);
+
+        if(compressed < 0) {
+            return CURL_READFUNC_ABORT;
+        }
+    }
+
+    atomic_fetch_add_explicit(&compressBytesOut, compressed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&compressTimeUs, getMonotonicMicroseconds() - startUs, memory_order_relaxed);
+
+    return compressed;
+}
+
+/**
+ * zlib's allocator, so deflate's state comes from the memory pool too
+ */
+static voidpf uploadZlibAlloc(voidpf opaque, uInt items, uInt size)
+{
+    return memCalloc(items, size);
+}
+
+static void uploadZlibFree(voidpf opaque, voidpf address)
+{
+    memFree(address);
+}
+
+/**
+ * set up the compressor chosen with --compress. Its state is kept, and reset for each batch, so compressing
+ * doesn't allocate once running
+ */
+int uploadCompressorInit(struct uploadBody * body)
+{
+    body->compressing = false;
+    memset(&body->gzip, 0, sizeof(body->gzip));
+
+#ifdef HAVE_ZSTD
+    body->zstd = NULL;
+
+    if(uploadCompression == UPLOAD_COMPRESS_ZSTD) {
+        body->zstd = ZSTD_createCCtx();
+
+        if(body->zstd == NULL) {
+            return -1;
+        }
+
+        ZSTD_CCtx_setParameter(body->zstd, ZSTD_c_compressionLevel, UPLOAD_ZSTD_LEVEL);
+        ZSTD_CCtx_setParameter(body->zstd, ZSTD_c_windowLog, UPLOAD_ZSTD_WINDOW_LOG);
+        return 0;
+    }
+#endif
+
+    if(uploadCompression == UPLOAD_COMPRESS_GZIP) {
+        body->gzip.zalloc = uploadZlibAlloc;
+        body->gzip.zfree = uploadZlibFree;
+        body->gzip.opaque = NULL;
+
+        // + 16 for a gzip header rather than a zlib one
+        if(deflateInit2(&body->gzip, UPLOAD_GZIP_LEVEL, Z_DEFLATED, UPLOAD_GZIP_WINDOW_BITS + 16, UPLOAD_GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void uploadCompressorCleanup(struct uploadBody * body)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(body->zstd);
+#endif
+
+    // still set up if the endpoint made us fall back to uncompressed bodies
+    if(body->gzip.zalloc != NULL) {
+        deflateEnd(&body->gzip);
+    }
+}
+
+/**
+ * start compressing a batch, if it is big enough to be worth it
+ */
+void uploadCompressorStart(struct uploadBody * body, long long bodyLength)
+{
+    body->compressing = uploadCompression != UPLOAD_COMPRESS_NONE && bodyLength >= uploadCompressMinBytes;
+
+    if(!body->compressing) {
+        return;
+    }
+
+    body->compressFinished = false;
+    body->plainLength = 0;
+    body->plainUsed = 0;
+    body->plainFinished = false;
+
+#ifdef HAVE_ZSTD
+    if(uploadCompression == UPLOAD_COMPRESS_ZSTD) {
+        ZSTD_CCtx_reset(body->zstd, ZSTD_reset_session_only);
+    }
+#endif
+
+    if(uploadCompression == UPLOAD_COMPRESS_GZIP) {
+        deflateReset(&body->gzip);
+    }
+
+    atomic_fetch_add_explicit(&compressBatchCount, 1, memory_order_relaxed);
+}
+
+/**
+ * the headers for the batch about to be posted - those for the body format, with a Content-Encoding if it is
+ * compressed. The compressed list is built once, and again only if the body format falls back
+ */
+void uploadSetHeaders(struct uploadContext * context)
+{
+    struct curl_slist * base = uploadBodyMode == UPLOAD_BODY_FORM ? context->headers : context->bodyHeaders;
+    struct curl_slist * header;
+
+    if(!context->body->compressing) {
+        curl_easy_setopt(context->curl, CURLOPT_HTTPHEADER, base);
+        return;
+    }
+
+    if(context->compressedHeaders == NULL || context->compressedHeadersBase != base) {
+        curl_slist_free_all(context->compressedHeaders);
+        context->compressedHeaders = NULL;
+
+        for(header = base; header != NULL; header = header->next) {
+            context->compressedHeaders = curl_slist_append(context->compressedHeaders, header->data);
+        }
+
+        context->compressedHeaders = curl_slist_append(context->compressedHeaders, uploadCompression == UPLOAD_COMPRESS_ZSTD ? "Content-Encoding: zstd" : "Content-Encoding: gzip");
+        context->compressedHeadersBase = base;
+    }
+
+    curl_easy_setopt(context->curl, CURLOPT_HTTPHEADER, context->compressedHeaders);
+}
+
+/**
+ * CURLOPT_WRITEFUNCTION - we don't need the response body, drop it
+ */
+static size_t uploadDiscardResponse(char * data, size_t size, size_t nmemb, void * userdata)
+{
+    return size * nmemb;
+}
+
+/**
+ * set up the long lived upload context. curl_global_init() must already have been called
+ */
+int uploadContextInit(struct uploadContext * context)
+{
+    context->body = memAlloc(sizeof(* context->body));
+
+    if(context->body == NULL) {
+        return -1;
+    }
+
+    context->body->fd = -1;
+    context->body->map = NULL;
+    context->body->recordCount = 0;
+    context->bodyHeaders = NULL;
+    context->compressedHeaders = NULL;
+    context->compressedHeadersBase = NULL;
+
+    if(uploadCompressorInit(context->body) < 0) {
+        memFree(context->body);
+        return -1;
+    }
+    context->body->payload = &context->payload;
+
+    // room for a batch's CSV with every byte encoded. Batches too big to keep are just encoded again on a retry
+    context->payload.capacity = uploadBatchBytes * 3 < UPLOAD_PAYLOAD_MAX_BYTES ? uploadBatchBytes * 3 : UPLOAD_PAYLOAD_MAX_BYTES;
+    context->payload.encoded = memAlloc(context->payload.capacity);
+    context->payload.length = 0;
+
+    if(context->payload.encoded == NULL) {
+        context->payload.capacity = 0;
+    }
+
+    //get a curl handle, kept for the life of the process so its connection is reused
+    context->curl = curl_easy_init();
+    context->probeCurl = curl_easy_init();
+    context->multi = curl_multi_init();
+    context->lastPostUs = 0;
+    context->holding = false;
+
+    if(context->curl == NULL || context->probeCurl == NULL || context->multi == NULL) {
+        curl_easy_cleanup(context->curl);
+        curl_easy_cleanup(context->probeCurl);
+        curl_multi_cleanup(context->multi);
+        uploadCompressorCleanup(context->body);
+        memFree(context->payload.encoded);
+        memFree(context->body);
+        return -1;
+    }
+
+    // probes are as cheap as we can make them - no body either way
+    curl_easy_setopt(context->probeCurl, CURLOPT_URL, endPointUrl);
+    curl_easy_setopt(context->probeCurl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(context->probeCurl, CURLOPT_CONNECTTIMEOUT_MS, uploadConnectTimeoutMs);
+    curl_easy_setopt(context->probeCurl, CURLOPT_TIMEOUT_MS, uploadTimeoutMs);
+    curl_easy_setopt(context->probeCurl, CURLOPT_NOSIGNAL, 1L);
+
+    atomic_store(&context->state, UPLOAD_IDLE);
+
+    // don't wait for a 100-continue before sending large bodies
+    context->headers = curl_slist_append(NULL, "Expect:");
+
+    // set the end point
+    curl_easy_setopt(context->curl, CURLOPT_URL, endPointUrl);
+
+    // specify post data, read from the file as it is sent
+    curl_easy_setopt(context->curl, CURLOPT_POST, 1L);
+    curl_easy_setopt(context->curl, CURLOPT_READFUNCTION, uploadBodyRead);
+    curl_easy_setopt(context->curl, CURLOPT_READDATA, context->body);
+    curl_easy_setopt(context->curl, CURLOPT_HTTPHEADER, context->headers);
+
+    // throw the response body away
+    curl_easy_setopt(context->curl, CURLOPT_WRITEFUNCTION, uploadDiscardResponse);
+
+    // keep the idle connection alive between uploads
+    curl_easy_setopt(context->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+    // small enough for the memory pool
+    curl_easy_setopt(context->curl, CURLOPT_UPLOAD_BUFFERSIZE, (long) UPLOAD_CURL_BUFFER_SIZE);
+    curl_easy_setopt(context->curl, CURLOPT_BUFFERSIZE, (long) UPLOAD_CURL_BUFFER_SIZE);
+
+    // a hung connection must not stall retrying forever
+    curl_easy_setopt(context->curl, CURLOPT_CONNECTTIMEOUT_MS, uploadConnectTimeoutMs);
+    curl_easy_setopt(context->curl, CURLOPT_TIMEOUT_MS, uploadTimeoutMs);
+
+    // curl must not use signals for its timeouts outside the main thread
+    curl_easy_setopt(context->curl, CURLOPT_NOSIGNAL, 1L);
+
+    return 0;
+}
+
+void uploadContextCleanup(struct uploadContext * context)
+{
+    curl_multi_cleanup(context->multi);
+    curl_easy_cleanup(context->probeCurl);
+    curl_easy_cleanup(context->curl);
+    curl_slist_free_all(context->headers);
+    curl_slist_free_all(context->bodyHeaders);
+    curl_slist_free_all(context->compressedHeaders);
+    uploadCompressorCleanup(context->body);
+    memFree(context->payload.encoded);
+    memFree(context->body);
+}
+
+/**
+ * blink the LED
+ */
+void ledBlink(int durationMs)
+{
+    digitalWrite(PIN_OUTPUT, HIGH);
+    delay(durationMs);
+    digitalWrite(PIN_OUTPUT, LOW);
+}
+
+/**
+ * blink LED for use with wiringPi threading interface
+ */
+PI_THREAD(ledSignalCounted)
+{
+    ledBlink(50);
+}
+
+/**
+ * check whether the kept payload is all of an earlier attempt at the batch starting at context->offset.
+ * Returns how much of the segment or ring it covers, or -1 if it isn't
+ */
+long long uploadPayloadMatch(struct uploadContext * context)
+{
+    const struct uploadPayload * payload = &context->payload;
+
+    if(payload->length == 0 || payload->length != (size_t) payload->encodedLength) {
+        return -1;
+    }
+
+    if(payload->source != context->source || payload->offset != context->offset || payload->bodyMode != uploadBodyMode) {
+        return -1;
+    }
+
+    if(context->source == UPLOAD_SOURCE_SEGMENT && (payload->segmentId != context->segmentId
+            || payload->device != context->segmentStat.st_dev
+            || payload->inode != context->segmentStat.st_ino
+            || payload->size != context->segmentStat.st_size
+            || payload->modified.tv_sec != context->segmentStat.st_mtim.tv_sec
+            || payload->modified.tv_nsec != context->segmentStat.st_mtim.tv_nsec)) {
+        return -1;
+    }
+
+    return payload->batchLength;
+}
+
+/**
+ * keep what is encoded of the batch about to be posted, after the body->payloadLength bytes already kept
+ */
+void uploadPayloadKeep(struct uploadContext * context, long long encodedLength)
+{
+    struct uploadPayload * payload = &context->payload;
+    struct uploadBody * body = context->body;
+
+    payload->source = context->source;
+    payload->segmentId = context->segmentId;
+    payload->device = context->segmentStat.st_dev;
+    payload->inode = context->segmentStat.st_ino;
+    payload->size = context->segmentStat.st_size;
+    payload->modified = context->segmentStat.st_mtim;
+    payload->offset = context->offset;
+    payload->batchLength = context->batchLength;
+    payload->encodedLength = encodedLength;
+    payload->bodyMode = uploadBodyMode;
+    payload->format = body->format;
+    payload->length = body->payloadLength;
+
+    body->payloadKeep = encodedLength <= (long long) payload->capacity;
+
+    if(body->payloadLength > 0) {
+        atomic_fetch_add_explicit(&payloadReusedCount, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&payloadReusedBytes, body->payloadLength, memory_order_relaxed);
+    }
+}
+
+/**
+ * map a CSV segment and choose the next batch of it, to be handed to curl as it is. Nothing is read or copied - curl
+ * sends straight from the page cache. Sets the length of the batch. Returns -1 if the segment can't be mapped
+ */
+int uploadBodyMapSegment(struct uploadContext * context, const char * path)
+{
+    struct uploadBody * body = context->body;
+    struct csvBatch batch = { 0 };
+    long long mapOffset = context->offset - context->offset % sysconf(_SC_PAGESIZE);
+    long long csvLength;
+    void * map;
+    bool full;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0) {
+        return -1;
+    }
+
+    map = mmap(NULL, context->segmentSize - mapOffset, PROT_READ, MAP_SHARED, fd, mapOffset);
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        LOG(LOG_ERROR, "Failed to map %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    body->map = map;
+    body->mapLength = context->segmentSize - mapOffset;
+    madvise(body->map, body->mapLength, MADV_SEQUENTIAL);
+
+    // what was committed to a segment doesn't change, so the batch can be chosen straight from the mapping
+    full = csvBatchScan(&batch, body->map + (context->offset - mapOffset), context->segmentSize - context->offset);
+    csvBatchFinish(&batch, full, &context->batchLength, &csvLength);
+
+    curl_easy_setopt(context->curl, CURLOPT_POSTFIELDS, body->map + (context->offset - mapOffset));
+
+    return 0;
+}
+
+/**
+ * unmap the segment the last batch was sent from, if it was
+ */
+void uploadBodyUnmap(struct uploadBody * body)
+{
+    if(body->map != NULL) {
+        munmap(body->map, body->mapLength);
+        body->map = NULL;
+    }
+}
+
+/**
+ * start posting the next batch of a CSV file, from the acknowledged offset, to an endpoint. The body is streamed
+ * from the file and URL encoded on the fly, so memory use doesn't depend on how big the file is.
+ * The transfer is driven by the multi handle - see requestPostCsvFinished()
+ * Based on the example from here: http://curl.haxx.se/libcurl/c/http-post.html
+ */
+int requestPostCsvStart(struct uploadContext * context, const char * path)
+{
+    struct uploadBody * body = context->body;
+    long long csvEncodedLength;
+    long long bodyLength = -1;
+    long long kept;
+    int batchSelected;
+
+    context->batchLength = 0;
+
+    body->source = context->source;
+    body->payloadLength = 0;
+    body->payloadSent = 0;
+    body->payloadKeep = false;
+
+    // staged hits can be flushed between attempts, so there is nothing to tie a kept payload to
+    kept = context->source == UPLOAD_SOURCE_STAGING ? -1 : uploadPayloadMatch(context);
+
+    if(kept >= 0 && body->source == UPLOAD_SOURCE_SEGMENT) {
+        // the segment hasn't changed, so the batch is exactly what was encoded last time - in the format it was
+        // read in then, which for hits from the cache isn't the segment's
+        body->fd = -1;
+        body->format = context->payload.format;
+        body->payloadLength = context->payload.length;
+        context->batchLength = kept;
+        csvEncodedLength = context->payload.length;
+        bodyLength = 0;
+    }
+    // the ring, staged and cached hits are binary records, read from memory
+    else if(body->source == UPLOAD_SOURCE_RING) {
+        body->fd = -1;
+        body->format = COUNT_FORMAT_BINARY;
+        body->ringOffset = context->offset;
+        ringSelectBatch(context->offset, context->segmentSize, &context->batchLength, &csvEncodedLength);
+
+        // hits written since the last attempt can make the batch longer - only they need encoding. The binary format
+        // encodes each hit against the one before, so there it is all or nothing
+        if(kept >= 0 && (context->batchLength == kept || (context->batchLength > kept && uploadBodyMode != UPLOAD_BODY_BINARY))) {
+            body->payloadLength = context->payload.length;
+            body->ringOffset += kept;
+            bodyLength = context->batchLength - kept;
+
+            if(uploadBodyMode == UPLOAD_BODY_BINARY) {
+                csvEncodedLength = context->payload.length;
+            }
+        }
+    }
+    else if(body->source == UPLOAD_SOURCE_STAGING) {
+        body->fd = -1;
+        body->format = COUNT_FORMAT_BINARY;
+        body->recordsOffset = 0;
+        stagingSelectBatch(body->records, body->recordCount, &context->batchLength, &csvEncodedLength);
+    }
+    else if(uploadBodyMode == UPLOAD_BODY_CSV && uploadCompression == UPLOAD_COMPRESS_NONE && context->segmentFormat == COUNT_FORMAT_CSV && uploadBodyMapSegment(context, path) == 0) {
+        // curl reads the body from the mapping, not through uploadBodyRead()
+        body->fd = -1;
+        body->format = COUNT_FORMAT_CSV;
+        csvEncodedLength = context->batchLength;
+        bodyLength = 0;
+    }
+    else if(cacheSelectBatch(context->segmentId, context->offset, body, &context->batchLength, &csvEncodedLength) == 0) {
+        // the batch's length in the segment is what is acknowledged, the body is its records
+        body->source = UPLOAD_SOURCE_CACHE;
+        body->fd = -1;
+        body->format = COUNT_FORMAT_BINARY;
+        body->recordsOffset = 0;
+        bodyLength = body->recordCount * sizeof(struct countRecord);
+    }
+    else {
+        body->fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if(body->fd < 0) {
+            LOG(LOG_ERROR, "Failed to open %s: %s", path, strerror(errno));
+            return -1;
+        }
+
+        body->format = context->segmentFormat;
+
+        if(body->format == COUNT_FORMAT_BINARY) {
+            batchSelected = fileSelectBinaryBatch(body->fd, context->offset, context->segmentSize, body->raw, sizeof(body->raw), &context->batchLength, &csvEncodedLength);
+        }
+        else if(body->format == COUNT_FORMAT_COMPRESSED) {
+            batchSelected = fileSelectCompressedBatch(body->fd, context->offset, context->segmentSize, body->block, body->blockRecords, &context->batchLength, &csvEncodedLength);
+        }
+        else {
+            batchSelected = fileSelectBatch(body->fd, context->offset, context->segmentSize, body->raw, sizeof(body->raw), &context->batchLength, &csvEncodedLength);
+        }
+
+        if(batchSelected < 0 || lseek(body->fd, context->offset, SEEK_SET) < 0) {
+            LOG(LOG_ERROR, "Failed to read %s: %s", path, strerror(errno));
+            close(body->fd);
+            body->fd = -1;
+            return -1;
+        }
+    }
+
+    body->remaining = bodyLength >= 0 ? bodyLength : context->batchLength;
+
+    // a mapped batch costs nothing to send again. The length of a binary body isn't known until it has all gone
+    if(body->source != UPLOAD_SOURCE_STAGING && body->map == NULL) {
+        uploadPayloadKeep(context, uploadBodyMode == UPLOAD_BODY_BINARY && body->payloadLength == 0 ? -1 : csvEncodedLength);
+    }
+
+    if(uploadBodyMode == UPLOAD_BODY_CSV) {
+        body->prefixLength = 0;
+    }
+    else if(uploadBodyMode == UPLOAD_BODY_BINARY) {
+        // a kept payload goes with the header it was encoded for. Otherwise CSV only has whole seconds, and no
+        // pulse widths
+        if(body->payloadLength > 0) {
+            body->wireFlags = context->payload.wireFlags;
+            body->wireTimeUnitUs = context->payload.wireTimeUnitUs;
+        }
+        else {
+            body->wireFlags = (body->format != COUNT_FORMAT_CSV ? WIRE_FLAG_PULSE_WIDTHS : 0) | (recordChannelId ? WIRE_FLAG_CHANNELS : 0);
+            body->wireTimeUnitUs = body->format != COUNT_FORMAT_CSV ? 1 : 1000000;
+        }
+
+        context->payload.wireFlags = body->wireFlags;
+        context->payload.wireTimeUnitUs = body->wireTimeUnitUs;
+        body->wirePreviousTime = 0;
+        body->lineLength = 0;
+        body->prefixLength = wireHeaderEncode(body, context->deviceId, (unsigned char *) body->prefix);
+    }
+    else {
+        body->prefixLength = snprintf(body->prefix, sizeof(body->prefix), "macAddress=%s&csv=", context->macAddress);
+        if(body->prefixLength >= sizeof(body->prefix)) {
+            body->prefixLength = sizeof(body->prefix) - 1;
+        }
+    }
+
+    // anything not mapped is read through uploadBodyRead()
+    if(body->map == NULL) {
+        curl_easy_setopt(context->curl, CURLOPT_POSTFIELDS, NULL);
+    }
+    body->prefixSent = 0;
+    body->encodedLength = 0;
+    body->encodedSent = 0;
+    body->blockRecordCount = 0;
+    body->blockRecordsConverted = 0;
+
+    LOG(LOG_INFO, "posting %lld bytes of %s from offset %lld (%lld bytes %s, %zu kept from the last attempt)",
+        context->batchLength,
+        body->map != NULL ? "mapped csv" : body->source == UPLOAD_SOURCE_CACHE ? "cached hits" : body->format == COUNT_FORMAT_CSV ? "csv" : body->format == COUNT_FORMAT_BINARY ? "records" : "blocks",
+        context->offset,
+        csvEncodedLength,
+        uploadBodyMode == UPLOAD_BODY_BINARY && body->payloadLength == 0 ? "of CSV, sent as binary" : "encoded",
+        body->payloadLength);
+
+    // a binary body is a fraction of its CSV - go by what it will be, not by the CSV
+    uploadCompressorStart(body, uploadBodyMode == UPLOAD_BODY_BINARY && body->payloadLength == 0
+        ? wireBodyLengthEstimate(body, csvEncodedLength) : (long long) body->prefixLength + csvEncodedLength);
+    uploadSetHeaders(context);
+
+    // sent chunked if it is compressed, or binary unless all of it was kept from the last attempt
+    if(body->compressing || (uploadBodyMode == UPLOAD_BODY_BINARY && body->payloadLength == 0)) {
+        curl_easy_setopt(context->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) -1);
+    }
+    else {
+        curl_easy_setopt(context->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)(body->prefixLength + csvEncodedLength));
+    }
+
+    // make the request
+    if(curl_multi_add_handle(context->multi, context->curl) != CURLM_OK) {
+        if(body->fd >= 0) {
+            close(body->fd);
+            body->fd = -1;
+        }
+        uploadBodyUnmap(body);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * start a probe of the endpoint - a HEAD request, so nothing is read from disk or encoded to find out if
+ * the endpoint is back
+ */
+int requestProbeStart(struct uploadContext * context)
+{
+    LOG(LOG_INFO, "probing endpoint");
+
+    if(curl_multi_add_handle(context->multi, context->probeCurl) != CURLM_OK) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * check whether the batch or probe in flight has finished. Returns 0 while it is still going, 1 once it has been
+ * answered and -1 if it failed. The endpoint being unavailable (5xx, or 429) counts as a failure. The endpoint
+ * refusing the request (any other 4xx, other than 408) returns -2 - sending the same batch again won't help.
+ * An endpoint that doesn't take a compressed body or the binary wire format (415) returns -3
+ */
+int requestFinished(struct uploadContext * context)
+{
+    CURLMsg * message;
+    int messagesLeft;
+    long responseCode = 0;
+    int returnValue = 0;
+
+    while((message = curl_multi_info_read(context->multi, &messagesLeft)) != NULL) {
+        if(message->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        returnValue = 1;
+
+        if(message->data.result != CURLE_OK) {
+            LOG(LOG_WARNING, "upload failed: %s", curl_easy_strerror(message->data.result));
+            returnValue = -1;
+        }
+        else {
+            curl_easy_getinfo(message->easy_handle, CURLINFO_RESPONSE_CODE, &responseCode);
+
+            if(responseCode >= 500 || responseCode == 429) {
+                LOG(LOG_WARNING, "upload failed: endpoint answered %ld", responseCode);
+                returnValue = -1;
+            }
+            else if(responseCode == 408) {
+                LOG(LOG_WARNING, "upload failed: endpoint timed out");
+                returnValue = -1;
+            }
+            else if(responseCode == 415 && (uploadBodyMode == UPLOAD_BODY_BINARY || context->body->compressing) && message->easy_handle == context->curl) {
+                LOG(LOG_WARNING, "upload refused: endpoint doesn't take the body (415)");
+                returnValue = -3;
+            }
+            else if(responseCode >= 400) {
+                LOG(LOG_WARNING, "upload refused: endpoint answered %ld", responseCode);
+                returnValue = -2;
+            }
+        }
+
+        curl_multi_remove_handle(context->multi, message->easy_handle);
+
+        if(message->easy_handle == context->curl && context->body->fd >= 0) {
+            close(context->body->fd);
+            context->body->fd = -1;
+        }
+
+        if(message->easy_handle == context->curl) {
+            uploadBodyUnmap(context->body);
+        }
+    }
+
+    return returnValue;
+}
+
+/**
+ * hand back the hits taken from the staging buffer, the first sent of them having been acknowledged
+ */
+void uploadReleaseStaged(struct uploadContext * context, unsigned int sent)
+{
+    if(context->source == UPLOAD_SOURCE_STAGING && context->body->recordCount > 0) {
+        stagingRelease(sent);
+        context->body->recordCount = 0;
+    }
+}
+
+/**
+ * post hits staged in RAM, once everything on the card has gone. Returns 1 if nothing is staged
+ */
+int uploadStartStaged(struct uploadContext * context)
+{
+    struct uploadBody * body = context->body;
+
+    body->recordCount = stagingTake(body->records, STAGING_UPLOAD_RECORDS);
+
+    if(body->recordCount == 0) {
+        return 1;
+    }
+
+    context->source = UPLOAD_SOURCE_STAGING;
+    context->offset = 0;
+    context->segmentSize = body->recordCount * sizeof(struct countRecord);
+
+    if(requestPostCsvStart(context, NULL) < 0) {
+        uploadReleaseStaged(context, 0);
+        return -1;
+    }
+
+    atomic_store(&context->state, UPLOAD_IN_FLIGHT);
+
+    return 0;
+}
+
+/**
+ * pick the oldest segment to upload, sealing the active one if everything else has gone. With the ring, take
+ * everything written to it so far. Returns -1 if there is nothing to upload
+ */
+int uploadPrepareSegment(struct uploadContext * context)
+{
+    char path[300];
+    char header[128];
+    char * macAddress;
+    long long committed;
+    int segmentFd;
+
+    // the MAC address doesn't change, only read it once
+    if(context->macAddress[0] == 0) {
+        macAddress = fileGetMacAddress();
+        snprintf(context->macAddress, sizeof(context->macAddress), "%s", macAddress);
+        memFree(macAddress);
+
+        // a header can't hold the newline the file ends with
+        if(uploadBodyMode == UPLOAD_BODY_CSV) {
+            snprintf(header, sizeof(header), "X-MAC-Address: %.*s", (int) strcspn(context->macAddress, "\r\n"), context->macAddress);
+            context->bodyHeaders = curl_slist_append(NULL, "Expect:");
+            context->bodyHeaders = curl_slist_append(context->bodyHeaders, "Content-Type: text/csv");
+            context->bodyHeaders = curl_slist_append(context->bodyHeaders, header);
+        }
+        else if(uploadBodyMode == UPLOAD_BODY_BINARY) {
+            sscanf(context->macAddress, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                &context->deviceId[0], &context->deviceId[1], &context->deviceId[2],
+                &context->deviceId[3], &context->deviceId[4], &context->deviceId[5]);
+            snprintf(header, sizeof(header), "X-Signal-Count-Format: %d", WIRE_VERSION);
+            context->bodyHeaders = curl_slist_append(NULL, "Expect:");
+            context->bodyHeaders = curl_slist_append(context->bodyHeaders, "Content-Type: application/octet-stream");
+            context->bodyHeaders = curl_slist_append(context->bodyHeaders, header);
+        }
+    }
+
+    // segments left from before the ring was used go first, so they aren't stranded
+    if(storageMode == STORAGE_RING && segmentPendingCount() == 0) {
+        context->source = UPLOAD_SOURCE_RING;
+
+        // up to the head the writer has committed - what is still buffered goes under the commit policy
+        pthread_mutex_lock(&countFileMutex);
+        context->offset = ringHeader->tail;
+        context->segmentSize = ringHeader->head;
+        pthread_mutex_unlock(&countFileMutex);
+
+        return context->offset < context->segmentSize ? 0 : -1;
+    }
+
+    context->source = UPLOAD_SOURCE_SEGMENT;
+
+    if(segmentNextForUpload(&context->segmentId, &committed) < 0) {
+        // nothing to process
+        return -1;
+    }
+
+    segmentPath(path, sizeof(path), context->segmentId, SEGMENT_SUFFIX_LOG);
+
+    segmentFd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(segmentFd < 0) {
+        LOG(LOG_INFO, "could not open segment %llu", context->segmentId);
+        return -1;
+    }
+
+    context->segmentFormat = fileGetCountFormat(segmentFd);
+    close(segmentFd);
+
+    if(stat(path, &context->segmentStat) < 0) {
+        LOG(LOG_INFO, "could not stat segment %llu", context->segmentId);
+        return -1;
+    }
+
+    // the active segment only goes as far as the writer has committed - it can be part way through a commit
+    context->segmentActive = committed >= 0;
+    context->segmentSize = context->segmentActive ? committed : context->segmentStat.st_size;
+
+    // carry on from the last acknowledged batch
+    context->offset = fileGetSegmentCursor(context->segmentId);
+
+    // the header isn't uploaded
+    if(context->segmentFormat != COUNT_FORMAT_CSV && context->offset < (long long) sizeof(struct countFileHeader)) {
+        context->offset = sizeof(struct countFileHeader);
+    }
+
+    return !context->segmentActive || context->offset < context->segmentSize ? 0 : -1;
+}
+
+/**
+ * the batch in flight was posted - move the cursor past it, and delete the segment once it has all gone
+ */
+void uploadBatchAcknowledged(struct uploadContext * context)
+{
+    context->offset += context->batchLength;
+
+    // the kept payload is only for retrying the batch
+    context->payload.length = 0;
+
+    // staged hits that have been sent never need to reach the card
+    if(context->source == UPLOAD_SOURCE_STAGING) {
+        uploadReleaseStaged(context, context->batchLength / sizeof(struct countRecord));
+        context->offset = context->segmentSize;
+        return;
+    }
+
+    // the ring's tail is its cursor, and frees the space for the writer
+    if(context->source == UPLOAD_SOURCE_RING) {
+        if(context->batchLength > 0) {
+            pthread_mutex_lock(&countFileMutex);
+            ringSetTail(context->offset);
+            pthread_mutex_unlock(&countFileMutex);
+        }
+        return;
+    }
+
+    // remember how far we got, so a retry or restart doesn't send this batch again. The active segment is only
+    // deleted once it has been sealed and the rest of it sent
+    if(context->offset < context->segmentSize || context->segmentActive) {
+        if(context->batchLength > 0) {
+            fileSetSegmentCursor(context->segmentId, context->offset);
+        }
+        return;
+    }
+
+    // successfully recorded, delete the segment
+    segmentUploaded(context->segmentId, false);
+
+    LOG(LOG_INFO, "segment %llu uploaded", context->segmentId);
+}
+
+/**
+ * the endpoint doesn't take the body - go back to uncompressed bodies, or from the binary wire format to the URL
+ * encoded form, for the rest of the run. The batch is sent again, so anything kept of it in the binary format is
+ * thrown away
+ */
+void uploadBodyFallBack(struct uploadContext * context)
+{
+    // take the compression off first, the format might be fine
+    if(context->body->compressing) {
+        LOG(LOG_INFO, "falling back to uncompressed bodies");
+        uploadCompression = UPLOAD_COMPRESS_NONE;
+    }
+    else {
+        LOG(LOG_INFO, "falling back to form bodies");
+        uploadBodyMode = UPLOAD_BODY_FORM;
+    }
+
+    context->payload.length = 0;
+    uploadReleaseStaged(context, 0);
+}
+
+/**
+ * the endpoint refused a batch - move the segment aside so the segments behind it aren't held up. There is
+ * nowhere to move part of the ring or the staged hits to, so a refused batch from them is skipped
+ */
+void uploadSegmentRejected(struct uploadContext * context)
+{
+    if(context->source != UPLOAD_SOURCE_SEGMENT) {
+        LOG(LOG_INFO, "%lld bytes of %s refused by the endpoint, skipped", context->batchLength, context->source == UPLOAD_SOURCE_RING ? "the ring" : "staged hits");
+        atomic_fetch_add_explicit(&segmentRejectedCount, 1, memory_order_relaxed);
+        uploadBatchAcknowledged(context);
+        return;
+    }
+
+    LOG(LOG_INFO, "segment %llu refused by the endpoint, kept as %010llu%s", context->segmentId, context->segmentId, SEGMENT_SUFFIX_REJECTED);
+
+    segmentUploaded(context->segmentId, true);
+    atomic_fetch_add_explicit(&segmentRejectedCount, 1, memory_order_relaxed);
+
+    context->offset = context->segmentSize;
+}
+
+/**
+ * start posting the next batch, moving on to the next segment if this one has all gone, and moving to
+ * UPLOAD_IN_FLIGHT. Returns -1 if there is nothing to send
+ */
+int uploadStartNext(struct uploadContext * context)
+{
+    char path[300];
+
+    // an empty segment has nothing to send, but still needs clearing up
+    while(context->offset >= context->segmentSize) {
+        context->batchLength = 0;
+        uploadBatchAcknowledged(context);
+
+        if(uploadPrepareSegment(context) < 0) {
+            return -1;
+        }
+    }
+
+    segmentPath(path, sizeof(path), context->segmentId, SEGMENT_SUFFIX_LOG);
+
+    if(requestPostCsvStart(context, path) < 0) {
+        return -1;
+    }
+
+    atomic_store(&context->state, UPLOAD_IN_FLIGHT);
+
+    return 0;
+}
+
+/**
+ * a batch or probe failed - back off for a random time up to backoffBaseMs * 2^failures (capped at backoffMaxMs),
+ * and open the circuit breaker once there have been breakerFailures failures in a row.
+ * The full jitter stops a fleet of devices retrying in step when the endpoint comes back
+ */
+void uploadFailed(struct uploadContext * context)
+{
+    unsigned long long ceilingMs = backoffBaseMs;
+    unsigned long long delayMs;
+    unsigned int i;
+
+    // staged hits that weren't sent can be flushed to the card while we wait
+    uploadReleaseStaged(context, 0);
+
+    context->consecutiveFailures++;
+
+    for(i = 1; i < context->consecutiveFailures && ceilingMs < (unsigned long long) backoffMaxMs; i++) {
+        ceilingMs *= 2;
+    }
+
+    if(ceilingMs > (unsigned long long) backoffMaxMs) {
+        ceilingMs = backoffMaxMs;
+    }
+
+    delayMs = ceilingMs > 0 ? (unsigned long long) random() % (ceilingMs + 1) : 0;
+
+    if(breakerFailures > 0 && context->consecutiveFailures >= (unsigned int) breakerFailures && !context->breakerOpen) {
+        LOG(LOG_INFO, "%u uploads failed in a row, circuit breaker open", context->consecutiveFailures);
+        context->breakerOpen = true;
+    }
+
+    LOG(LOG_INFO, "retrying upload in %llums", delayMs);
+
+    context->backoffUntilUs = getMonotonicMicroseconds() + delayMs * 1000;
+    atomic_store(&context->state, UPLOAD_BACKOFF);
+}
+
+/**
+ * how long to hold new hits back for a fuller batch, in ms - until uploadMaxEvents are waiting, or
+ * uploadMaxDelayMs after the last batch was started. 0 to look for something to send now: nothing new has been
+ * committed (anything waiting is a backlog), the batch is full, or the uploader has been quiet long enough
+ */
+long long uploadHoldMs(struct uploadContext * context, unsigned long long nowUs)
+{
+    unsigned int pending = atomic_load_explicit(&uploadPendingEvents, memory_order_relaxed);
+    unsigned long long sinceMs = (nowUs - context->lastPostUs) / 1000;
+
+    if(pending == 0) {
+        return 0;
+    }
+
+    if(pending >= (unsigned long) uploadMaxEvents) {
+        atomic_fetch_add_explicit(&batchFullCount, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    if(sinceMs >= (unsigned long long) uploadMaxDelayMs) {
+        atomic_fetch_add_explicit(context->holding ? &batchDelayedCount : &batchAtOnceCount, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    return uploadMaxDelayMs - sinceMs;
+}
+
+/**
+ * take the upload state machine one step. Returns how long until it needs to run again in ms, 0 to run it
+ * again straight away, or -1 if it is waiting for curl or for hits to be committed
+ */
+long long uploadStep(struct uploadContext * context)
+{
+    long long waitMs = -1;
+    int finished;
+    long long holdMs;
+    unsigned long long nowUs;
+
+    switch(atomic_load(&context->state)) {
+        case UPLOAD_IDLE:
+            nowUs = getMonotonicMicroseconds();
+            holdMs = uploadHoldMs(context, nowUs);
+
+            if(holdMs > 0) {
+                context->holding = true;
+                waitMs = holdMs;
+                break;
+            }
+
+            // everything committed until now is looked for, so a hit committed from here on wakes us again
+            context->holding = false;
+            atomic_store_explicit(&uploadPendingEvents, 0, memory_order_relaxed);
+
+            // is there anything to send? What is on the card goes first, then anything staged in RAM
+            if(uploadPrepareSegment(context) == 0) {
+                if(uploadStartNext(context) < 0) {
+                    uploadFailed(context);
+                    waitMs = 0;
+                }
+            }
+            else if((stagingFlushMs > 0 || stagingFlushEvents > 0) && uploadStartStaged(context) < 0) {
+                uploadFailed(context);
+                waitMs = 0;
+            }
+
+            if(atomic_load(&context->state) == UPLOAD_IN_FLIGHT) {
+                context->lastPostUs = nowUs;
+            }
+            break;
+
+        case UPLOAD_IN_FLIGHT:
+            // curl's sockets and timer are driven by the event loop, just see if it has finished
+            finished = requestFinished(context);
+
+            if(finished > 0) {
+                context->consecutiveFailures = 0;
+                uploadBatchAcknowledged(context);
+
+                // carry straight on with the next batch, if there is one
+                if(context->offset >= context->segmentSize || uploadStartNext(context) < 0) {
+                    atomic_store(&context->state, UPLOAD_IDLE);
+                }
+                waitMs = 0;
+            }
+            else if(finished == -3) {
+                // send this batch and the rest as a form, the way every endpoint takes them
+                uploadBodyFallBack(context);
+                atomic_store(&context->state, UPLOAD_IDLE);
+                waitMs = 0;
+            }
+            else if(finished == -2) {
+                // the endpoint is up, it just doesn't want this segment
+                context->consecutiveFailures = 0;
+                uploadSegmentRejected(context);
+                atomic_store(&context->state, UPLOAD_IDLE);
+                waitMs = 0;
+            }
+            else if(finished < 0) {
+                uploadFailed(context);
+                waitMs = 0;
+            }
+            break;
+
+        case UPLOAD_PROBING:
+            finished = requestFinished(context);
+
+            if(finished > 0 || finished == -2) {
+                // the endpoint is back, go straight back to uploading
+                LOG(LOG_INFO, "endpoint answered, circuit breaker closed");
+                context->breakerOpen = false;
+                context->consecutiveFailures = 0;
+                atomic_store(&context->state, UPLOAD_IDLE);
+                waitMs = 0;
+            }
+            else if(finished < 0) {
+                uploadFailed(context);
+                waitMs = 0;
+            }
+            break;
+
+        case UPLOAD_BACKOFF:
+            nowUs = getMonotonicMicroseconds();
+
+            if(nowUs >= context->backoffUntilUs) {
+                // with the breaker open, check the endpoint is back before sending anything
+                if(context->breakerOpen && requestProbeStart(context) == 0) {
+                    atomic_store(&context->state, UPLOAD_PROBING);
+                }
+                else if(context->breakerOpen) {
+                    uploadFailed(context);
+                }
+                else {
+                    atomic_store(&context->state, UPLOAD_IDLE);
+                }
+                waitMs = 0;
+            }
+            else {
+                // rounded up, so the timer doesn't fire just short of the deadline
+                waitMs = (context->backoffUntilUs - nowUs + 999) / 1000;
+            }
+            break;
+    }
+
+    return waitMs;
+}
+
+void uploadPrintStats(struct uploadContext * context)
+{
+    static const char * states[] = { "idle", "in flight", "backoff", "probing" };
+    unsigned long long bytesIn;
+    unsigned long long bytesOut;
+    unsigned long long timeUs;
+    unsigned long long ringWaiting;
+    unsigned int staged;
+
+    if(cacheSize > 0 && storageMode == STORAGE_SEGMENTS) {
+        LOG(LOG_INFO, "stats: cache %llu batches posted from RAM, %llu read back from the card",
+            atomic_load(&cacheHitCount),
+            atomic_load(&cacheMissCount));
+    }
+
+    LOG(LOG_INFO, "stats: batching %llu batches sent at once, %llu full, %llu after waiting for more hits",
+        atomic_load(&batchAtOnceCount),
+        atomic_load(&batchFullCount),
+        atomic_load(&batchDelayedCount));
+
+    LOG(LOG_INFO, "stats: payload %llu retries sent without encoding again, %llu bytes kept",
+        atomic_load(&payloadReusedCount),
+        atomic_load(&payloadReusedBytes));
+
+    if(uploadCompression != UPLOAD_COMPRESS_NONE) {
+        bytesIn = atomic_load(&compressBytesIn);
+        bytesOut = atomic_load(&compressBytesOut);
+        timeUs = atomic_load(&compressTimeUs);
+
+        LOG(LOG_INFO, "stats: compression %llu batches, %llu bytes to %llu (ratio %.2f), %.1f MB/s",
+            atomic_load(&compressBatchCount),
+            bytesIn,
+            bytesOut,
+            bytesOut > 0 ? (double) bytesIn / bytesOut : 0.0,
+            timeUs > 0 ? bytesIn / (double) timeUs : 0.0);
+    }
+
+    if(stagingFlushMs > 0 || stagingFlushEvents > 0) {
+        pthread_mutex_lock(&countFileMutex);
+        staged = stagingCount;
+        pthread_mutex_unlock(&countFileMutex);
+
+        LOG(LOG_INFO, "stats: staging %u hits in RAM, %llu sent from RAM, %llu flushed to the card",
+            staged,
+            atomic_load(&stagingSentCount),
+            atomic_load(&stagingFlushedCount));
+    }
+
+    if(storageMode == STORAGE_RING) {
+        pthread_mutex_lock(&countFileMutex);
+        ringWaiting = ringHeader->head - ringHeader->tail;
+        pthread_mutex_unlock(&countFileMutex);
+
+        LOG(LOG_INFO, "stats: upload %s, consecutive failures %u, circuit breaker %s, %llu of %llu ring bytes waiting, %llu hits dropped, %llu refused",
+            states[atomic_load(&context->state)],
+            context->consecutiveFailures,
+            context->breakerOpen ? "open" : "closed",
+            ringWaiting,
+            (unsigned long long) ringCapacity,
+            atomic_load(&ringDroppedCount),
+            atomic_load(&segmentRejectedCount));
+        return;
+    }
+
+    LOG(LOG_INFO, "stats: upload %s, consecutive failures %u, circuit breaker %s, %d segment(s) waiting, %llu dropped, %llu refused",
+        states[atomic_load(&context->state)],
+        context->consecutiveFailures,
+        context->breakerOpen ? "open" : "closed",
+        segmentPendingCount(),
+        atomic_load(&segmentDroppedCount),
+        atomic_load(&segmentRejectedCount));
+}
+
+/**
+ * queue a hit for the writer thread. Never blocks - if the ring is full the hit is dropped and counted
+ */
+bool signalRingPush(struct signalRing * ring, const struct signalEvent * event)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned int used = head - tail;
+
+    if(used >= SIGNAL_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->overflowCount, 1, memory_order_relaxed);
+        return false;
+    }
+
+    ring->events[head & (SIGNAL_RING_SIZE - 1)] = * event;
+
+    // publish the event to the consumer
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    used++;
+    if(used > atomic_load_explicit(&ring->highWatermark, memory_order_relaxed)) {
+        atomic_store_explicit(&ring->highWatermark, used, memory_order_relaxed);
+    }
+
+    return true;
+}
+
+/**
+ * take up to maxEvents hits off the ring, returns the number copied into events
+ */
+unsigned int signalRingPopBatch(struct signalRing * ring, struct signalEvent * events, unsigned int maxEvents)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned int count = head - tail;
+    unsigned int i;
+
+    if(count > maxEvents) {
+        count = maxEvents;
+    }
+
+    for(i = 0; i < count; i++) {
+        events[i] = ring->events[(tail + i) & (SIGNAL_RING_SIZE - 1)];
+    }
+
+    // hand the slots back to the producer
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+
+    return count;
+}
+
+void signalChannelPrintStats(struct signalChannel * channel)
+{
+    LOG(LOG_INFO, "stats: channel %d: recorded %llu, rejected %llu, queue high watermark %u/%d, queue overflows %llu, edges lost %llu",
+        channel->id,
+        atomic_load(&channel->recordedCount),
+        atomic_load(&channel->rejectedCount),
+        atomic_load(&channel->ring.highWatermark),
+        SIGNAL_RING_SIZE,
+        atomic_load(&channel->ring.overflowCount),
+        atomic_load(&channel->edgeLostCount));
+}
+
+/**
+ * take everything queued on every channel's ring and record it. Only one thread may drain at a time.
+ * Returns how many hits were taken
+ */
+unsigned int signalRingsDrain(void)
+{
+    struct signalEvent events[SIGNAL_WRITER_BATCH];
+    struct signalChannel * channel;
+    unsigned int count;
+    unsigned int total = 0;
+    unsigned int i;
+    int c;
+
+    for(c = 0; c < channelCount; c++) {
+        channel = &channels[c];
+
+        while((count = signalRingPopBatch(&channel->ring, events, SIGNAL_WRITER_BATCH)) > 0) {
+            for(i = 0; i < count; i++) {
+                LOG(LOG_DEBUG, "new signal on channel %d - interval was %lluus", channel->id, events[i].intervalUs);
+
+                // only anchor to the wall clock now, so a clock step can't upset the debounce
+                if(fileRecordSignalCount(clockMonotonicToRealtimeUs(events[i].timeUs), events[i].intervalUs, events[i].channel) == 0) {
+                    atomic_fetch_add_explicit(&channel->recordedCount, 1, memory_order_relaxed);
+                }
+            }
+
+            total += count;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * drain hits queued by the ISR and persist them, so slow SD card writes and the LED blink
+ * happen outside the interrupt thread
+ */
+PI_THREAD(signalWriter)
+{
+    unsigned int total;
+    unsigned long long deadlineUs;
+    unsigned long long nowUs;
+    struct timespec timeout;
+
+    for(;;) {
+        // wait for an ISR to queue something, or for buffered hits to become due
+        deadlineUs = fileCommitDeadlineUs();
+
+        if(deadlineUs == 0) {
+            if(sem_wait(&signalRingSemaphore) < 0) {
+                continue;
+            }
+        }
+        else {
+            // sem_timedwait only takes a wall clock deadline, so convert the time remaining
+            nowUs = getMonotonicMicroseconds();
+            deadlineUs = deadlineUs > nowUs ? deadlineUs - nowUs : 0;
+
+            clock_gettime(CLOCK_REALTIME, &timeout);
+            timeout.tv_sec += deadlineUs / 1000000;
+            timeout.tv_nsec += (deadlineUs % 1000000) * 1000;
+            if(timeout.tv_nsec >= 1000000000) {
+                timeout.tv_sec++;
+                timeout.tv_nsec -= 1000000000;
+            }
+
+            if(sem_timedwait(&signalRingSemaphore, &timeout) < 0) {
+                if(errno == ETIMEDOUT) {
+                    fileCommitTimer();
+                }
+                continue;
+            }
+        }
+
+        // one post per hit, but take everything that is waiting on every channel while we are awake
+        do {
+            total = signalRingsDrain();
+
+            // blink the LED to show we recorded the signal(s)
+            if(total > 0) {
+                ledBlink(50);
+            }
+        } while(total > 0);
+
+        // shutting down - leave the rest to shutdownCommit()
+        if(atomic_load(&captureStopped)) {
+            sem_post(&signalWriterStoppedSemaphore);
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * debounce an edge on a channel, queueing a hit for the writer thread at the end of a long enough pulse.
+ * Called from the capture thread(s) - nothing in here may block
+ */
+void signalChannelEdge(struct signalChannel * channel, bool active, unsigned long long interruptTimeUs)
+{
+    if(atomic_load_explicit(&captureStopped, memory_order_relaxed)) {
+        return;
+    }
+
+    if(active) {
+        // start of a pulse
+        channel->interruptTimeUsActive = interruptTimeUs;
+        return;
+    }
+
+    // Was there a preceding start of pulse detected?
+    if(channel->interruptTimeUsActive == 0) {
+        // No start of pulse, ignore
+        return;
+    }
+
+    // else, end of pulse
+    unsigned long long intervalTimeUs = interruptTimeUs - channel->interruptTimeUsActive;
+
+    // reset, ready for next event
+    channel->interruptTimeUsActive = 0;
+
+    // nothing in here may block - count rejects rather than printing them
+    if(intervalTimeUs < (unsigned long long) channel->triggerIntervalUs) {
+        atomic_fetch_add_explicit(&channel->rejectedCount, 1, memory_order_relaxed);
+        return;
+    }
+
+    // hand the hit to the writer thread, which records it to file and blinks the LED
+    struct signalEvent event = { .timeUs = interruptTimeUs, .intervalUs = intervalTimeUs, .channel = channel->id };
+
+    if(signalRingPush(&channel->ring, &event)) {
+        sem_post(&signalRingSemaphore);
+    }
+}
+
+/**
+ * the interrupt to fire when a channel's input pin changes level
+ */
+void signalIsr(struct signalChannel * channel)
+{
+    unsigned long long interruptTimeUs = getMonotonicMicroseconds();
+
+    // determine whether this is the start or the end of a pulse
+    int level = digitalRead(channel->pin);
+    bool active = (channel->edge == INT_EDGE_FALLING) ? (level == 0) : (level == 1);
+
+    signalChannelEdge(channel, active, interruptTimeUs);
+}
+
+/**
+ * wiringPiISR takes a function with no arguments, so each channel slot gets a trampoline
+ */
+#define CHANNEL_ISR(n) static void signalIsrChannel##n(void) { signalIsr(&channels[n]); }
+
+CHANNEL_ISR(0)
+CHANNEL_ISR(1)
+CHANNEL_ISR(2)
+CHANNEL_ISR(3)
+CHANNEL_ISR(4)
+CHANNEL_ISR(5)
+CHANNEL_ISR(6)
+CHANNEL_ISR(7)
+
+static void (* const channelIsrs[CHANNEL_MAX])(void) = {
+    signalIsrChannel0, signalIsrChannel1, signalIsrChannel2, signalIsrChannel3,
+    signalIsrChannel4, signalIsrChannel5, signalIsrChannel6, signalIsrChannel7
+};
+
+/**
+ * request every channel's line from the GPIO character device as one line request, with edge detection
+ * on both edges. Each channel's pin is its line offset on the chip
+ */
+int gpioRequestLines(const char * chipPath)
+{
+    struct gpio_v2_line_request request;
+    unsigned long long activeLowMask = 0;
+    int chipFd;
+    int c;
+
+    chipFd = open(chipPath, O_RDONLY | O_CLOEXEC);
+
+    if(chipFd < 0) {
+        LOG(LOG_ERROR, "Failed to open GPIO chip %s: %s", chipPath, strerror(errno));
+        return -1;
+    }
+
+    memset(&request, 0, sizeof(request));
+
+    for(c = 0; c < channelCount; c++) {
+        request.offsets[c] = channels[c].pin;
+
+        if(channels[c].edge == INT_EDGE_FALLING) {
+            activeLowMask |= 1ULL << c;
+        }
+    }
+
+    request.num_lines = channelCount;
+    request.event_buffer_size = GPIO_EVENT_BUFFER_SIZE;
+    snprintf(request.consumer, sizeof(request.consumer), "signalCounter");
+
+    // the kernel timestamps each edge with CLOCK_MONOTONIC, so pulse widths don't include our scheduling latency
+    request.config.flags = GPIO_V2_LINE_FLAG_INPUT
+        | GPIO_V2_LINE_FLAG_EDGE_RISING
+        | GPIO_V2_LINE_FLAG_EDGE_FALLING
+        | GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+
+    // active low lines are pulled up, and marked active low so a rising edge is always the start of a pulse
+    if(activeLowMask != 0) {
+        request.config.num_attrs = 1;
+        request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+        request.config.attrs[0].attr.flags = GPIO_V2_LINE_FLAG_INPUT
+            | GPIO_V2_LINE_FLAG_ACTIVE_LOW
+            | GPIO_V2_LINE_FLAG_EDGE_RISING
+            | GPIO_V2_LINE_FLAG_EDGE_FALLING
+            | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+        request.config.attrs[0].mask = activeLowMask;
+    }
+
+    if(ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
+        LOG(LOG_ERROR, "Failed to request GPIO lines from %s: %s", chipPath, strerror(errno));
+        close(chipFd);
+        return -1;
+    }
+
+    // the line request holds its own reference to the chip
+    close(chipFd);
+
+    gpioLineFd = request.fd;
+
+    return 0;
+}
+
+/**
+ * find the channel counting the given line offset
+ */
+struct signalChannel * gpioChannelForOffset(unsigned int offset)
+{
+    int c;
+
+    for(c = 0; c < channelCount; c++) {
+        if((unsigned int) channels[c].pin == offset) {
+            return &channels[c];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * read edge events for every channel from the GPIO character device, several per read().
+ * This is the only producer for every channel's ring when capturing this way
+ */
+PI_THREAD(gpioReader)
+{
+    struct gpio_v2_line_event events[GPIO_EVENT_BATCH];
+    struct signalChannel * channel;
+    ssize_t bytesRead;
+    int count;
+    int i;
+
+    for(;;) {
+        bytesRead = read(gpioLineFd, events, sizeof(events));
+
+        if(bytesRead < 0) {
+            if(errno != EINTR) {
+                LOG(LOG_ERROR, "Failed to read GPIO events: %s", strerror(errno));
+                delay(1000);
+            }
+            continue;
+        }
+
+        count = bytesRead / sizeof(events[0]);
+
+        for(i = 0; i < count; i++) {
+            channel = gpioChannelForOffset(events[i].offset);
+
+            if(channel == NULL) {
+                continue;
+            }
+
+            // the kernel numbers each line's events, a gap means its buffer overflowed
+            if(channel->lineSeqno != 0 && events[i].line_seqno != channel->lineSeqno + 1) {
+                atomic_fetch_add_explicit(&channel->edgeLostCount, events[i].line_seqno - channel->lineSeqno - 1, memory_order_relaxed);
+            }
+            channel->lineSeqno = events[i].line_seqno;
+
+            signalChannelEdge(channel,
+                events[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE,
+                events[i].timestamp_ns / 1000);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * fill csv with length bytes of typical count CSV - a hit every ~2s, over four channels. The last line may be cut
+ * short, so csv needs 64 bytes more than length
+ */
+void benchmarkCsv(char * csv, size_t length)
+{
+    struct countRecord record = { 0 };
+    unsigned long long timeUs = getCurrentMicroseconds();
+    size_t offset;
+
+    for(offset = 0; offset < length; offset += countRecordToCsv(&record, csv + offset, 64)) {
+        timeUs += 1900000 + random() % 200000;
+        record.timeUs = timeUs;
+        record.channel = random() % 4;
+    }
+}
+
+/**
+ * time one way of URL encoding csv, a chunk at a time as uploads do, passes times over. Returns MB/s, and the
+ * encoded length of one pass
+ */
+double benchmarkUrlEncodeRun(const char * csv, size_t length, unsigned int passes, size_t chunkSize, char * output, int encoder, CURL * curl, size_t * encodedLength)
+{
+    unsigned long long startUs = getMonotonicMicroseconds();
+    unsigned long long elapsedUs;
+    unsigned int pass;
+    size_t offset;
+    size_t chunk;
+    char * escaped;
+
+    for(pass = 0; pass < passes; pass++) {
+        * encodedLength = 0;
+
+        for(offset = 0; offset < length; offset += chunk) {
+            chunk = length - offset < chunkSize ? length - offset : chunkSize;
+
+            if(encoder == 0) {
+                escaped = curl_easy_escape(curl, csv + offset, chunk);
+                * encodedLength += strlen(escaped);
+                curl_free(escaped);
+            }
+            else if(encoder == 1) {
+                * encodedLength += urlEncodeScalar(csv + offset, chunk, output);
+            }
+            else {
+                * encodedLength += urlEncode(csv + offset, chunk, output);
+            }
+        }
+    }
+
+    elapsedUs = getMonotonicMicroseconds() - startUs;
+
+    return length / 1048576.0 * passes * 1000000.0 / (elapsedUs > 0 ? elapsedUs : 1);
+}
+
+/**
+ * compare urlEncode() with the byte at a time encoder it falls back to and curl_easy_escape(), on 1MB and 100MB of
+ * count CSV, 1MB at a time. The 1MB is encoded 100 times over to get a measurable time
+ */
+void benchmarkUrlEncode(void)
+{
+    static const char * encoders[] = { "curl_easy_escape", "scalar", "urlEncode" };
+    static const size_t sizes[] = { 1048576, 104857600 };
+    size_t encodedLength;
+    double mbPerSecond;
+    unsigned int s;
+    int e;
+    char * csv;
+    char * output;
+    char * escaped;
+    CURL * curl;
+
+    csv = memAlloc(sizes[1] + 64);
+    output = memAlloc(sizes[0] * 3 + URL_ENCODE_SLACK);
+    curl = curl_easy_init();
+
+    if(csv == NULL || output == NULL || curl == NULL) {
+        fprintf(stderr, "benchmark: unable to allocate the URL encoding buffers\n");
+        memFree(csv);
+        memFree(output);
+        curl_easy_cleanup(curl);
+        return;
+    }
+
+    benchmarkCsv(csv, sizes[1]);
+
+    // check it is the same encoding
+    escaped = curl_easy_escape(curl, csv, sizes[0]);
+    if(escaped == NULL || urlEncode(csv, sizes[0], output) != strlen(escaped) || memcmp(output, escaped, strlen(escaped)) != 0) {
+        fprintf(stderr, "benchmark: urlEncode doesn't match curl_easy_escape\n");
+    }
+    curl_free(escaped);
+
+    for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for(e = 0; e < 3; e++) {
+            mbPerSecond = benchmarkUrlEncodeRun(csv, sizes[s], sizes[1] / sizes[s], sizes[0], output, e, curl, &encodedLength);
+            fprintf(stderr, "benchmark: URL encode %4zuMB %-16s %8.1f MB/s (%zu bytes encoded)\n", sizes[s] / 1048576, encoders[e], mbPerSecond, encodedLength);
+        }
+    }
+
+    curl_easy_cleanup(curl);
+    memFree(output);
+    memFree(csv);
+}
+
+/**
+ * compress a body the way uploads do - through the body's compressor, a read buffer at a time. Returns MB/s of
+ * input, and the compressed length
+ */
+double benchmarkCompressionRun(struct uploadBody * body, const char * input, size_t length, char * output, size_t * compressedLength)
+{
+    unsigned long long startUs = getMonotonicMicroseconds();
+    unsigned long long elapsedUs;
+    size_t offset = 0;
+    ssize_t compressed;
+
+    uploadCompressorStart(body, length);
+    * compressedLength = 0;
+
+    while(!body->compressFinished) {
+        if(body->plainUsed == body->plainLength && !body->plainFinished) {
+            body->plainLength = length - offset < sizeof(body->plain) ? length - offset : sizeof(body->plain);
+            memcpy(body->plain, input + offset, body->plainLength);
+            offset += body->plainLength;
+            body->plainUsed = 0;
+            body->plainFinished = body->plainLength == 0;
+        }
+
+        compressed = uploadBodyCompress(body, output, UPLOAD_CURL_BUFFER_SIZE);
+        if(compressed < 0) {
+            return 0;
+        }
+        * compressedLength += compressed;
+    }
+
+    elapsedUs = getMonotonicMicroseconds() - startUs;
+
+    return length / 1048576.0 * 1000000.0 / (elapsedUs > 0 ? elapsedUs : 1);
+}
+
+/**
+ * compare the compressors on a batch worth and 16MB of count CSV, as it is and URL encoded in a form
+ */
+void benchmarkCompression(void)
+{
+    static const size_t sizes[] = { 65536, 16777216 };
+    static const char * bodies[] = { "csv", "form" };
+    enum uploadCompressions compression = uploadCompression;
+    struct uploadBody * body;
+    size_t compressedLength;
+    size_t encodedLength;
+    double mbPerSecond;
+    unsigned int s;
+    int b;
+    int c;
+    char * csv;
+    char * encoded;
+    char * output;
+
+    csv = memAlloc(sizes[1] + 64);
+    encoded = memAlloc(sizes[1] * 3 + URL_ENCODE_SLACK);
+    output = memAlloc(UPLOAD_CURL_BUFFER_SIZE);
+    body = memAlloc(sizeof(* body));
+
+    if(csv == NULL || encoded == NULL || output == NULL || body == NULL) {
+        fprintf(stderr, "benchmark: unable to allocate the compression buffers\n");
+        memFree(csv);
+        memFree(encoded);
+        memFree(output);
+        memFree(body);
+        return;
+    }
+
+    benchmarkCsv(csv, sizes[1]);
+    encodedLength = urlEncode(csv, sizes[1], encoded);
+
+    uploadCompressMinBytes = 0;
+
+    for(c = UPLOAD_COMPRESS_GZIP; c <= UPLOAD_COMPRESS_ZSTD; c++) {
+#ifndef HAVE_ZSTD
+        if(c == UPLOAD_COMPRESS_ZSTD) {
+            break;
+        }
+#endif
+        uploadCompression = c;
+        if(uploadCompressorInit(body) < 0) {
+            fprintf(stderr, "benchmark: unable to set up %s\n", c == UPLOAD_COMPRESS_GZIP ? "gzip" : "zstd");
+            continue;
+        }
+
+        for(s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            for(b = 0; b < 2; b++) {
+                mbPerSecond = benchmarkCompressionRun(body, b == 0 ? csv : encoded, b == 0 ? sizes[s] : encodedLength * sizes[s] / sizes[1], output, &compressedLength);
+                fprintf(stderr, "benchmark: compress %5zuKB %-4s %-4s %8.1f MB/s, ratio %.2f\n",
+                    sizes[s] / 1024,
+                    bodies[b],
+                    c == UPLOAD_COMPRESS_GZIP ? "gzip" : "zstd",
+                    mbPerSecond,
+                    compressedLength > 0 ? (double)(b == 0 ? sizes[s] : encodedLength * sizes[s] / sizes[1]) / compressedLength : 0.0);
+            }
+        }
+
+        uploadCompressorCleanup(body);
+    }
+
+    uploadCompression = compression;
+    uploadCompressMinBytes = UPLOAD_COMPRESS_MIN_BYTES;
+
+    memFree(body);
+    memFree(output);
+    memFree(encoded);
+    memFree(csv);
+}
+
+/**
+ * measure how many hits per second each commit policy can record, writing to a scratch file next to
+ * the count file
+ */
+void benchmarkCommitPolicies(void)
+{
+    const char * policies[] = { "write", "events:64", "ms:100", "sync" };
+    char benchmarkPath[300];
+    unsigned long long startUs;
+    unsigned long long elapsedUs;
+    unsigned long long events;
+    unsigned int p;
+
+    // a scratch segment directory, and one segment for the whole run
+    snprintf(segmentDirectory, sizeof(segmentDirectory), "%s/benchmark", countDirectory);
+    segmentMaxBytes = LLONG_MAX;
+    segmentMaxAgeMs = 0;
+    segmentPath(benchmarkPath, sizeof(benchmarkPath), segmentActiveId, SEGMENT_SUFFIX_LOG);
+
+    for(p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        commitPolicyParse(policies[p]);
+        events = 0;
+        startUs = getMonotonicMicroseconds();
+
+        // run each policy for 2s
+        do {
+            fileRecordSignalCount(getCurrentMicroseconds(), 0, 0);
+            fileCommitTimer();
+            events++;
+            elapsedUs = getMonotonicMicroseconds() - startUs;
+        } while(elapsedUs < 2000000);
+
+        pthread_mutex_lock(&countFileMutex);
+        fileCommitCountBuffer(true);
+        close(countFileFd);
+        countFileFd = -1;
+        pthread_mutex_unlock(&countFileMutex);
+
+        remove(benchmarkPath);
+
+        fprintf(stderr, "benchmark: commit policy %-10s %10.0f events/s\n", policies[p], events * 1000000.0 / elapsedUs);
+    }
+}
+
+/**
+ * bytes written to the block device holding path since boot, or if that can't be found, bytes this process has
+ * caused to be written. Sets source to say which
+ */
+long long storageBytesWritten(const char * path, const char ** source)
+{
+    char statPath[64];
+    char buffer[512];
+    struct stat pathStat;
+    unsigned long long sectors;
+    long long bytes = -1;
+    char * field;
+    FILE * file;
+
+    if(stat(path, &pathStat) == 0) {
+        snprintf(statPath, sizeof(statPath), "/sys/dev/block/%u:%u/stat", major(pathStat.st_dev), minor(pathStat.st_dev));
+
+        file = fopen(statPath, "r");
+
+        // the 7th field is sectors written, always of 512 bytes
+        if(file != NULL) {
+            if(fscanf(file, "%*u %*u %*u %*u %*u %*u %llu", &sectors) == 1) {
+                * source = "device";
+                bytes = sectors * 512;
+            }
+            fclose(file);
+        }
+    }
+
+    if(bytes >= 0) {
+        return bytes;
+    }
+
+    // tmpfs, overlays and the like have no device of their own
+    file = fopen("/proc/self/io", "r");
+
+    if(file == NULL) {
+        return -1;
+    }
+
+    while(fgets(buffer, sizeof(buffer), file) != NULL) {
+        if((field = strstr(buffer, "write_bytes:")) == buffer) {
+            * source = "process";
+            bytes = strtoll(field + strlen("write_bytes:"), NULL, 10);
+            break;
+        }
+    }
+
+    fclose(file);
+
+    return bytes;
+}
+
+/**
+ * record the same hits through the append path (binary segments) and the ring, and compare what reaches the
+ * device with the bytes of records written. Includes the filesystem's metadata and journal writes when the
+ * device's counters can be read, and so anything else writing to the device at the same time
+ */
+void benchmarkWriteAmplification(void)
+{
+    const char * policies[] = { "events:64", "sync" };
+    const unsigned int hits = 10000;
+    const char * source = "none";
+    char benchmarkPath[300];
+    long long before;
+    long long after;
+    unsigned int s;
+    unsigned int p;
+    unsigned int i;
+
+    countFormat = COUNT_FORMAT_BINARY;
+
+    for(s = 0; s < 2; s++) {
+        for(p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+            commitPolicyParse(policies[p]);
+
+            if(s == 0) {
+                storageMode = STORAGE_SEGMENTS;
+                segmentPath(benchmarkPath, sizeof(benchmarkPath), segmentActiveId, SEGMENT_SUFFIX_LOG);
+            }
+            else {
+                // the ring is created and preallocated before measuring - that only happens once
+                storageMode = STORAGE_RING;
+                snprintf(benchmarkPath, sizeof(benchmarkPath), "%s/benchmark.ring", countDirectory);
+                if(ringOpen(benchmarkPath) < 0) {
+                    return;
+                }
+            }
+
+            sync();
+            before = storageBytesWritten(countDirectory, &source);
+
+            for(i = 0; i < hits; i++) {
+                fileRecordSignalCount(getCurrentMicroseconds(), 0, 0);
+                fileCommitTimer();
+            }
+
+            pthread_mutex_lock(&countFileMutex);
+            fileCommitCountBuffer(true);
+            if(countFileFd >= 0) {
+                close(countFileFd);
+                countFileFd = -1;
+            }
+            ringClose();
+            pthread_mutex_unlock(&countFileMutex);
+
+            sync();
+            after = storageBytesWritten(countDirectory, &source);
+
+            remove(benchmarkPath);
+
+            fprintf(stderr, "benchmark: %-6s %-10s %10lld bytes written for %u bytes of records, write amplification %.1f (%s counters)\n",
+                s == 0 ? "append" : "ring",
+                policies[p],
+                after - before,
+                hits * (unsigned int) sizeof(struct countRecord),
+                (double)(after - before) / (hits * sizeof(struct countRecord)),
+                source);
+        }
+    }
+
+    rmdir(segmentDirectory);
+}
+
+/**
+ * time from a lone hit being recorded to the uploader having a batch of it ready to post, with the active segment
+ * never due to be sealed. The commit policy still decides when the hit reaches the segment, the segment's limits
+ * add nothing
+ */
+void benchmarkLoneHit(void)
+{
+    const char * policies[] = { "write", "ms:100" };
+    struct uploadContext context = { 0 };
+    char benchmarkPath[300];
+    char cursorPath[300];
+    unsigned long long startUs;
+    unsigned long long elapsedUs;
+    bool ready;
+    unsigned int p;
+
+    storageMode = STORAGE_SEGMENTS;
+    segmentMaxBytes = LLONG_MAX;
+    segmentMaxAgeMs = 0;
+
+    for(p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+        commitPolicyParse(policies[p]);
+        segmentPath(benchmarkPath, sizeof(benchmarkPath), segmentActiveId, SEGMENT_SUFFIX_LOG);
+        segmentPath(cursorPath, sizeof(cursorPath), segmentActiveId, SEGMENT_SUFFIX_CURSOR);
+
+        // a quiet spell since the last POST, so nothing is held back for batching
+        context.lastPostUs = 0;
+
+        startUs = getMonotonicMicroseconds();
+        fileRecordSignalCount(getCurrentMicroseconds(), 0, 0);
+
+        // poll as the upload loop would be woken, giving up after 10s
+        do {
+            fileCommitTimer();
+            ready = uploadPrepareSegment(&context) == 0 && context.offset < context.segmentSize && uploadHoldMs(&context, getMonotonicMicroseconds()) == 0;
+            elapsedUs = getMonotonicMicroseconds() - startUs;
+            if(!ready) {
+                usleep(1000);
+            }
+        } while(!ready && elapsedUs < 10000000);
+
+        pthread_mutex_lock(&countFileMutex);
+        fileCommitCountBuffer(true);
+        if(countFileFd >= 0) {
+            close(countFileFd);
+            countFileFd = -1;
+        }
+        pthread_mutex_unlock(&countFileMutex);
+
+        remove(benchmarkPath);
+        remove(cursorPath);
+
+        if(ready) {
+            fprintf(stderr, "benchmark: lone hit %-10s ready to post after %.1f ms (--max-delay-ms %lld, segment never sealed)\n", policies[p], elapsedUs / 1000.0, uploadMaxDelayMs);
+        }
+        else {
+            fprintf(stderr, "benchmark: lone hit %-10s not ready to post after 10s\n", policies[p]);
+        }
+    }
+
+    rmdir(segmentDirectory);
+}
+
+/**
+ * parse a whole, non-negative number given as an option
+ */
+int optionParseNumber(const char * value, long long * number)
+{
+    char * p;
+
+    errno = 0;
+    * number = strtoll(value, &p, 10);
+
+    if(* p != '\0' || p == value || errno != 0 || * number < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * change one of the settings that can be changed while running - batching, backoff and segment limits - by the
+ * name of its long option. The writer reads the segment limits and max events, so they change under
+ * countFileMutex. With check set nothing is changed. Returns -1 if it isn't one of those settings
+ */
+int settingSet(const char * name, long long number, bool check)
+{
+    static const char * names[] = {
+        "batch-bytes", "batch-records", "max-events", "max-delay-ms", "backoff-base-ms", "backoff-max-ms",
+        "breaker-failures", "segment-bytes", "segment-ms", "retain-segments"
+    };
+    unsigned int i;
+
+    for(i = 0; i < sizeof(names) / sizeof(names[0]) && strcmp(name, names[i]) != 0; i++);
+
+    if(i == sizeof(names) / sizeof(names[0])) {
+        return -1;
+    }
+
+    if(check) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&countFileMutex);
+
+    switch(i) {
+        case 0:
+            uploadBatchBytes = number > 0 ? number : 1;
+            break;
+        case 1:
+            uploadBatchRecords = number;
+            break;
+        case 2:
+            uploadMaxEvents = number > 0 ? number : 1;
+            break;
+        case 3:
+            uploadMaxDelayMs = number;
+            break;
+        case 4:
+            backoffBaseMs = number;
+            break;
+        case 5:
+            backoffMaxMs = number;
+            break;
+        case 6:
+            breakerFailures = number;
+            break;
+        case 7:
+            segmentMaxBytes = number > 0 ? number : 1;
+            break;
+        case 8:
+            segmentMaxAgeMs = number;
+            break;
+        case 9:
+            segmentRetain = number;
+            break;
+    }
+
+    pthread_mutex_unlock(&countFileMutex);
+
+    return 0;
+}
+
+/**
+ * read the settings that can be changed while running from configPath, one "name value" per line with the name
+ * of the long option. Blank lines and lines starting with # are skipped. Nothing is changed unless every line is
+ * good. Returns -1 if the file can't be read or has a line that isn't a setting
+ */
+int configLoad(void)
+{
+    char names[CONFIG_LINES][32];
+    long long numbers[CONFIG_LINES];
+    char line[256];
+    char name[32];
+    char value[64];
+    int count = 0;
+    int lineNumber = 0;
+    int fields;
+    int i;
+    FILE * file;
+
+    file = fopen(configPath, "r");
+
+    if(file == NULL) {
+        LOG(LOG_ERROR, "Failed to open config file %s: %s", configPath, strerror(errno));
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), file) != NULL) {
+        lineNumber++;
+
+        fields = sscanf(line, "%31s %63s", name, value);
+
+        if(fields <= 0 || name[0] == '#') {
+            continue;
+        }
+
+        if(count == CONFIG_LINES || fields != 2 || optionParseNumber(value, &numbers[count]) < 0 || settingSet(name, 0, true) < 0) {
+            LOG(LOG_ERROR, "invalid setting in %s line %d, nothing changed", configPath, lineNumber);
+            fclose(file);
+            return -1;
+        }
+
+        snprintf(names[count++], sizeof(names[0]), "%s", name);
+    }
+
+    fclose(file);
 
-// the count file is moved to here before it is submitted
-#define PATH_SIGNAL_COUNT_SWAP "/var/lib/signalCounter/count.swp"
+    for(i = 0; i < count; i++) {
+        settingSet(names[i], numbers[i], false);
+    }
 
-#define PATH_MAC_ADDRESS_ETH0 "/sys/class/net/eth0/address"
+    LOG(LOG_INFO, "%d setting(s) read from %s", count, configPath);
 
-// where the signal count CSV string will be posted to
-char endPointUrl[1024];
+    return 0;
+}
+
+/**
+ * parse a trigger interval given in (possibly fractional) ms into us
+ */
+int intervalParse(const char * value, long long int * intervalUs)
+{
+    char * p; // will be set to the "first invalid character" set by strtod
+    double intervalMs;
+
+    errno = 0;
+    intervalMs = strtod(value, &p);
 
-// number of ms we want signal for before counting as an actual hit (debouncing)
-long int triggerInterval = 300;
+    // inf, nan and anything that won't fit in us are refused, rather than overflowing the conversion
+    if(* p != '\0' || p == value || errno != 0 || !isfinite(intervalMs) || intervalMs < 0 || intervalMs >= LLONG_MAX / 1000) {
+        return -1;
+    }
 
-static unsigned long long interruptTimeMsRising = 0;
+    * intervalUs = (long long int)(intervalMs * 1000 + 0.5);
 
-// are we currently submitting the signal count?
-static bool isProcessingCountFile = false;
+    return 0;
+}
 
 /**
- * record the signal count to CSV file
+ * parse a channel definition of the form id:pin[:rising|falling[:trigger_interval_ms]]
  */
-int fileRecordSignalCount(unsigned long long interruptTimeMs)
+int channelParse(const char * definition, struct signalChannel * channel)
 {
-    // try and create the directory structure
-    char characterArray[256];
+    char buffer[64];
+    char * fields[4];
     char * p;
-    p = NULL;
-    size_t len;
-    FILE * filePointerCount;
-
-    // convert the string to a 'character array'
-    snprintf(characterArray, sizeof(characterArray), "%s", PATH_SIGNAL_COUNT);
-
-    len = strlen(characterArray);
+    int fieldCount = 0;
 
-    // remove last \n char and null terminate
-    if(characterArray[len - 1] == '/') {
-        characterArray[len - 1] = 0;
-    }
+    snprintf(buffer, sizeof(buffer), "%s", definition);
 
-    // loop over each character, via the character pointer
-    for(p = characterArray + 1; * p; p++) {
-        // break at each '/' and create the dir
-        if(* p == '/') {
+    // split on ':'
+    fields[fieldCount++] = buffer;
+    for(p = buffer; * p && fieldCount < 4; p++) {
+        if(* p == ':') {
             * p = 0;
-            // we're modifiying string's pointer, but how does it know what char to read up to??
-            mkdir(characterArray);
-            * p = '/';
+            fields[fieldCount++] = p + 1;
         }
     }
 
-    // create/open existing file for append
-    filePointerCount = fopen(PATH_SIGNAL_COUNT, "a");
+    if(fieldCount < 2) {
+        return -1;
+    }
 
-    if(filePointerCount == NULL) {
-        fprintf(stderr, "Failed to open count file: %s\n", strerror(errno));
+    errno = 0;
+    channel->id = strtol(fields[0], &p, 10);
+    if(* p != '\0' || errno != 0) {
         return -1;
     }
 
-    // convert ms to s
-    fprintf(filePointerCount, "%llu\n", (interruptTimeMs / 1000));
+    channel->pin = strtol(fields[1], &p, 10);
+    if(* p != '\0' || errno != 0) {
+        return -1;
+    }
 
-    fclose(filePointerCount);
+    channel->edge = INT_EDGE_RISING;
+    if(fieldCount > 2) {
+        if(strcmp(fields[2], "falling") == 0) {
+            channel->edge = INT_EDGE_FALLING;
+        }
+        else if(strcmp(fields[2], "rising") != 0) {
+            return -1;
+        }
+    }
 
-    printf("signal was recorded to file\n");
+    channel->triggerIntervalUs = -1;
+    if(fieldCount > 3 && intervalParse(fields[3], &channel->triggerIntervalUs) < 0) {
+        return -1;
+    }
 
     return 0;
 }
 
-int fileSwapFileExists(void)
+/**
+ * arm a timerfd to fire once in ms, or disarm it if ms is -1. A timerfd set to 0 is disarmed, so 0 ms fires
+ * after a nanosecond instead
+ */
+void eventLoopArm(int timerFd, long long ms)
 {
-    return access(PATH_SIGNAL_COUNT_SWAP, F_OK);
+    struct itimerspec spec = { 0 };
+
+    if(ms >= 0) {
+        spec.it_value.tv_sec = ms / 1000;
+        spec.it_value.tv_nsec = (ms % 1000) * 1000000 + (ms == 0);
+    }
+
+    timerfd_settime(timerFd, 0, &spec, NULL);
 }
 
-int fileCountFileExists(void)
+/**
+ * CURLMOPT_SOCKETFUNCTION - watch the sockets curl wants watched in the event loop's epoll
+ */
+static int eventLoopCurlSocket(CURL * easy, curl_socket_t socket, int what, void * userp, void * socketp)
 {
-    return access(PATH_SIGNAL_COUNT, F_OK);
+    struct eventLoop * loop = userp;
+    struct epoll_event event = { 0 };
+
+    if(what == CURL_POLL_REMOVE) {
+        // curl may already have closed it, which takes it out of epoll anyway
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, socket, NULL);
+        return 0;
+    }
+
+    event.events = (what & CURL_POLL_IN ? EPOLLIN : 0) | (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+    event.data.fd = socket;
+
+    if(epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, socket, &event) < 0 && errno == ENOENT) {
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, socket, &event);
+    }
+
+    return 0;
 }
 
-int fileMoveCountToSwap(void)
+/**
+ * CURLMOPT_TIMERFUNCTION - curl wants curl_multi_socket_action() called in timeoutMs, or never for -1
+ */
+static int eventLoopCurlTimer(CURLM * multi, long timeoutMs, void * userp)
 {
-    return rename(PATH_SIGNAL_COUNT, PATH_SIGNAL_COUNT_SWAP);
+    struct eventLoop * loop = userp;
+
+    eventLoopArm(loop->curlTimerFd, timeoutMs);
+
+    return 0;
 }
 
 /**
- * read the whole swap file into memory. If this proves too memory hungry, split into smaller chunks
- *
+ * set up the event loop and hand curl's sockets and timer to it. SIGINT, SIGTERM and SIGHUP are blocked and read
+ * from a signalfd instead, so this must run before any other thread is started - they inherit the mask
  */
-char * fileGetFileContents(char * filename)
+int eventLoopInit(struct eventLoop * loop, struct uploadContext * context)
 {
-    char * fileContents;
-    unsigned long fileSize;
-    unsigned int bytesRead;
-    FILE * fileHandle;
+    struct epoll_event event = { 0 };
+    struct itimerspec stats = { { STATS_INTERVAL, 0 }, { STATS_INTERVAL, 0 } };
+    sigset_t signals;
+    int * fds[] = { &loop->wakeFd, &loop->uploadTimerFd, &loop->curlTimerFd, &loop->statsTimerFd, &loop->signalFd };
+    unsigned int i;
 
-    fileHandle = fopen(filename, "rb");
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
 
-    // move file pointer to the end of the file
-    fseek(fileHandle, 0, SEEK_END);
+    if(pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+        return -1;
+    }
 
-    // the position of the file pointer now
-    fileSize = ftell(fileHandle);
+    loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop->uploadTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->curlTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->statsTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
 
-    // move the pointer back to the start of the file
-    rewind(fileHandle);
+    if(loop->epollFd < 0) {
+        LOG(LOG_ERROR, "Unable to create the event loop: %s", strerror(errno));
+        return -1;
+    }
 
-    // allocate memory, include an extra byte for null terminate char
-    fileContents = malloc(fileSize + 1);
+    for(i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        event.events = EPOLLIN;
+        event.data.fd = * fds[i];
 
-    // load the contents of the file into the fileContents var
-    bytesRead = fread(fileContents, 1, fileSize, fileHandle);
+        if(* fds[i] < 0 || epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, * fds[i], &event) < 0) {
+            LOG(LOG_ERROR, "Unable to create the event loop: %s", strerror(errno));
+            return -1;
+        }
+    }
 
-    fclose(fileHandle);
+    timerfd_settime(loop->statsTimerFd, 0, &stats, NULL);
 
-    // null terminate
-    // @gotcha - null terminate at bytes read, not fileSize bytes. For non-real (OS) files,
-    // a block (4096bytes) is returned
-    fileContents[bytesRead] = 0;
+    curl_multi_setopt(context->multi, CURLMOPT_SOCKETFUNCTION, eventLoopCurlSocket);
+    curl_multi_setopt(context->multi, CURLMOPT_SOCKETDATA, loop);
+    curl_multi_setopt(context->multi, CURLMOPT_TIMERFUNCTION, eventLoopCurlTimer);
+    curl_multi_setopt(context->multi, CURLMOPT_TIMERDATA, loop);
 
-    return fileContents;
+    return 0;
 }
 
-char * fileGetSwapFileContents(void)
+void eventLoopCleanup(struct eventLoop * loop)
 {
-    return fileGetFileContents(PATH_SIGNAL_COUNT_SWAP);
+    int * fds[] = { &loop->epollFd, &loop->wakeFd, &loop->uploadTimerFd, &loop->curlTimerFd, &loop->statsTimerFd, &loop->signalFd };
+    unsigned int i;
+
+    for(i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if(* fds[i] >= 0) {
+            close(* fds[i]);
+            * fds[i] = -1;
+        }
+    }
 }
 
-char * fileGetMacAddress(void)
+void eventLoopPrintStats(struct uploadContext * context)
 {
-    return fileGetFileContents(PATH_MAC_ADDRESS_ETH0);
+    int c;
+
+    for(c = 0; c < channelCount; c++) {
+        signalChannelPrintStats(&channels[c]);
+    }
+
+    LOG(LOG_INFO, "stats: commit %llu failed, hits kept buffered for the next", atomic_load(&commitFailedCount));
+
+    uploadPrintStats(context);
+    memPrintStats();
 }
 
 /**
- * Submit (via HTTP POST) the CSV to an endpoint
- * Based on the example from here: http://curl.haxx.se/libcurl/c/http-post.html
+ * a signal has arrived. SIGHUP reopens the log file, reads the config file again, prints the stats and cuts any
+ * backoff short, so a backlog is retried straight away once the network is back. Returns 1 for SIGINT or
+ * SIGTERM, to shut down
  */
-int requestPostCsv(char * macAddress, char * csv)
+int eventLoopSignal(struct eventLoop * loop, struct uploadContext * context)
 {
-    CURL * curl;
-    char * postString;
-    FILE * devNull;
-    char * csvUrlEncoded;
-    int returnValue = 0;
+    struct signalfd_siginfo info;
 
-    // init
-    curl_global_init(CURL_GLOBAL_ALL);
-
-    //get a curl handle
-    curl = curl_easy_init();
+    while(read(loop->signalFd, &info, sizeof(info)) == sizeof(info)) {
+        if(info.ssi_signo != SIGHUP) {
+            LOG(LOG_INFO, "%s, shutting down", strsignal(info.ssi_signo));
+            return 1;
+        }
 
-    if(curl) {
-        // set the end point
-        curl_easy_setopt(curl, CURLOPT_URL, endPointUrl);
+        LOG(LOG_INFO, "hangup, reopening the log, reloading the settings and retrying uploads now");
+        logReopen();
 
-        // url encode, to keep newline chars
-        csvUrlEncoded = (char*) curl_easy_escape(curl, csv, 0);
+        // a config file that doesn't read leaves the settings as they were
+        if(configPath[0] != 0) {
+            configLoad();
+        }
 
-        asprintf(&postString, "macAddress=%s&csv=%s", macAddress, csvUrlEncoded);
+        eventLoopPrintStats(context);
 
-        printf("combined string is this: %s\n", postString);
+        if(atomic_load(&context->state) == UPLOAD_BACKOFF) {
+            context->backoffUntilUs = getMonotonicMicroseconds();
+        }
+    }
 
-        // specify post data
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postString);
+    return 0;
+}
 
-        // send response body to /dev/null
-        devNull = fopen("/dev/null", "w+");
+/**
+ * run the uploads until SIGINT or SIGTERM, sleeping in epoll_wait whenever nothing is happening. Returns 0 on a
+ * signal to shut down, -1 if epoll fails
+ */
+int eventLoopRun(struct eventLoop * loop, struct uploadContext * context)
+{
+    struct epoll_event events[EVENT_LOOP_EVENTS];
+    uint64_t value;
+    long long waitMs;
+    int running;
+    int count;
+    int mask;
+    int fd;
+    int i;
 
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, devNull);
+    for(;;) {
+        // run the upload state machine until it has to wait for something
+        while((waitMs = uploadStep(context)) == 0) {
+        }
 
-        // make the request
-        CURLcode res;
+        eventLoopArm(loop->uploadTimerFd, waitMs);
 
-        res = curl_easy_perform(curl);
+        count = epoll_wait(loop->epollFd, events, EVENT_LOOP_EVENTS, -1);
 
-        fclose(devNull);
+        if(count < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
 
-        if(res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            returnValue = -1;
+            LOG(LOG_ERROR, "Event loop failed: %s", strerror(errno));
+            return -1;
         }
 
-        // clean up
-        free(postString);
-
-        curl_free(csvUrlEncoded);
+        for(i = 0; i < count; i++) {
+            fd = events[i].data.fd;
 
-        curl_easy_cleanup(curl);
-    }
+            if(fd == loop->signalFd) {
+                if(eventLoopSignal(loop, context) > 0) {
+                    return 0;
+                }
+            }
+            else if(fd == loop->wakeFd || fd == loop->uploadTimerFd || fd == loop->statsTimerFd || fd == loop->curlTimerFd) {
+                // hits committed or a timer due - read it so it stops being readable, the state machine runs next.
+                // They are all non-blocking, and another event on the same fd may have already been read
+                if(read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN && errno != EINTR) {
+                    LOG(LOG_ERROR, "Failed to read event: %s", strerror(errno));
+                }
 
-    curl_global_cleanup();
+                if(fd == loop->statsTimerFd) {
+                    eventLoopPrintStats(context);
+                }
+                else if(fd == loop->curlTimerFd) {
+                    curl_multi_socket_action(context->multi, CURL_SOCKET_TIMEOUT, 0, &running);
+                }
+            }
+            else {
+                // one of curl's sockets
+                mask = (events[i].events & EPOLLIN ? CURL_CSELECT_IN : 0)
+                    | (events[i].events & EPOLLOUT ? CURL_CSELECT_OUT : 0)
+                    | (events[i].events & (EPOLLERR | EPOLLHUP) ? CURL_CSELECT_ERR : 0);
 
-    return returnValue;
+                curl_multi_socket_action(context->multi, fd, mask, &running);
+            }
+        }
+    }
 }
 
 /**
- * blink the LED
+ * commit everything still queued, buffered or staged before exiting, so a clean shutdown loses nothing. Capture
+ * is stopped and the writer thread let go first, so the rings can be drained here. A batch of staged hits in
+ * flight is abandoned so they can be flushed. countFileMutex is kept, so nothing is recorded behind the final commit
  */
-void ledBlink(int durationMs)
+void shutdownCommit(struct uploadContext * context)
 {
-    digitalWrite(PIN_OUTPUT, HIGH);
-    delay(durationMs);
-    digitalWrite(PIN_OUTPUT, LOW);
+    if(atomic_load(&context->state) == UPLOAD_IN_FLIGHT) {
+        curl_multi_remove_handle(context->multi, context->curl);
+        uploadReleaseStaged(context, 0);
+    }
+
+    atomic_store(&captureStopped, true);
+    sem_post(&signalRingSemaphore);
+
+    while(sem_wait(&signalWriterStoppedSemaphore) < 0 && errno == EINTR) {
+    }
+
+    // anything an edge queued while the writer was finishing
+    signalRingsDrain();
+
+    pthread_mutex_lock(&countFileMutex);
+
+    if(fileCommitCountBuffer(true) < 0 || stagingFlush() < 0) {
+        LOG(LOG_ERROR, "Failed to commit hits before shutting down");
+    }
 }
 
 /**
- * blink LED for use with wiringPi threading interface
+ * init and run the application
  */
-PI_THREAD(ledSignalCounted)
+int main(int argc, char *argv[])
 {
-    ledBlink(50);
-}
+    int option;
+    int optionIndex;
+    long long number;
+    int c;
+    bool benchmark = false;
+    char ringPath[256];
 
-void processCountFile(void)
-{
-    // are we already processing something?
-    if(isProcessingCountFile) {
-        printf("something is already being processed\n");
-        return;
-    }
+    crc32cInit();
 
-    // prevent the thread starting multiple times
-    isProcessingCountFile = true;
+    // settings without a short option. Those from OPTION_NUMERIC on take a number
+    enum {
+        OPTION_FORMAT = 256,
+        OPTION_TO_CSV,
+        OPTION_STORAGE,
+        OPTION_BODY,
+        OPTION_COMPRESS,
+        OPTION_LOG_LEVEL,
+        OPTION_LOG_FILE,
+        OPTION_CONFIG,
+        OPTION_NUMERIC,
+        OPTION_BATCH_BYTES = OPTION_NUMERIC,
+        OPTION_BATCH_RECORDS,
+        OPTION_CONNECT_TIMEOUT,
+        OPTION_TIMEOUT,
+        OPTION_BACKOFF_BASE,
+        OPTION_BACKOFF_MAX,
+        OPTION_BREAKER_FAILURES,
+        OPTION_SEGMENT_BYTES,
+        OPTION_SEGMENT_MS,
+        OPTION_RETAIN_SEGMENTS,
+        OPTION_RING_BYTES,
+        OPTION_STAGING_FLUSH_MS,
+        OPTION_STAGING_FLUSH_EVENTS,
+        OPTION_CACHE_RECORDS,
+        OPTION_COMPRESS_MIN_BYTES,
+        OPTION_MAX_EVENTS,
+        OPTION_MAX_DELAY,
+        OPTION_LOG_MAX_BYTES,
+        OPTION_LOG_RATE
+    };
 
-    // does a swap already exist?
-    // this will normally be false, unless something crashed / lost power
-    // before it was submitted in a previous run
-    if(fileSwapFileExists() < 0) {
-        // no swap file. Is there anything to process?
-        if(fileCountFileExists() < 0) {
-            printf("nothing to process\n");
-            // nothing to process
-            isProcessingCountFile = false;
-            return;
-        }
-        else {
-            printf("count file exists\n");
-        }
+    static const struct option longOptions[] = {
+        { "format", required_argument, NULL, OPTION_FORMAT },
+        { "to-csv", required_argument, NULL, OPTION_TO_CSV },
+        { "storage", required_argument, NULL, OPTION_STORAGE },
+        { "body", required_argument, NULL, OPTION_BODY },
+        { "compress", required_argument, NULL, OPTION_COMPRESS },
+        { "log-level", required_argument, NULL, OPTION_LOG_LEVEL },
+        { "log-file", required_argument, NULL, OPTION_LOG_FILE },
+        { "config", required_argument, NULL, OPTION_CONFIG },
+        { "batch-bytes", required_argument, NULL, OPTION_BATCH_BYTES },
+        { "batch-records", required_argument, NULL, OPTION_BATCH_RECORDS },
+        { "connect-timeout-ms", required_argument, NULL, OPTION_CONNECT_TIMEOUT },
+        { "timeout-ms", required_argument, NULL, OPTION_TIMEOUT },
+        { "backoff-base-ms", required_argument, NULL, OPTION_BACKOFF_BASE },
+        { "backoff-max-ms", required_argument, NULL, OPTION_BACKOFF_MAX },
+        { "breaker-failures", required_argument, NULL, OPTION_BREAKER_FAILURES },
+        { "segment-bytes", required_argument, NULL, OPTION_SEGMENT_BYTES },
+        { "segment-ms", required_argument, NULL, OPTION_SEGMENT_MS },
+        { "retain-segments", required_argument, NULL, OPTION_RETAIN_SEGMENTS },
+        { "ring-bytes", required_argument, NULL, OPTION_RING_BYTES },
+        { "staging-flush-ms", required_argument, NULL, OPTION_STAGING_FLUSH_MS },
+        { "staging-flush-events", required_argument, NULL, OPTION_STAGING_FLUSH_EVENTS },
+        { "cache-records", required_argument, NULL, OPTION_CACHE_RECORDS },
+        { "compress-min-bytes", required_argument, NULL, OPTION_COMPRESS_MIN_BYTES },
+        { "max-events", required_argument, NULL, OPTION_MAX_EVENTS },
+        { "max-delay-ms", required_argument, NULL, OPTION_MAX_DELAY },
+        { "log-max-bytes", required_argument, NULL, OPTION_LOG_MAX_BYTES },
+        { "log-rate", required_argument, NULL, OPTION_LOG_RATE },
+        { NULL, 0, NULL, 0 }
+    };
 
-        // move the count file to the swap file
-        if(fileMoveCountToSwap() < 0) {
-            // something went wrong
-            printf("could not move count to swap\n");
-            isProcessingCountFile = false;
-            return;
+    while((option = getopt_long(argc, argv, "c:g:d:C:B", longOptions, &optionIndex)) != -1)
+    {
+        if(option >= OPTION_NUMERIC && optionParseNumber(optarg, &number) < 0)
+        {
+            fprintf(stderr, "invalid %s [%s]\n", longOptions[optionIndex].name, optarg);
+            return 1;
         }
-        else {
-            printf("moved count file to swap\n");
+
+        switch(option)
+        {
+            case OPTION_FORMAT:
+                if(strcmp(optarg, "csv") == 0)
+                {
+                    countFormat = COUNT_FORMAT_CSV;
+                }
+                else if(strcmp(optarg, "binary") == 0)
+                {
+                    countFormat = COUNT_FORMAT_BINARY;
+                }
+                else if(strcmp(optarg, "compressed") == 0)
+                {
+                    countFormat = COUNT_FORMAT_COMPRESSED;
+                }
+                else
+                {
+                    fprintf(stderr, "invalid format [%s]\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPTION_STORAGE:
+                if(strcmp(optarg, "segments") == 0)
+                {
+                    storageMode = STORAGE_SEGMENTS;
+                }
+                else if(strcmp(optarg, "ring") == 0)
+                {
+                    storageMode = STORAGE_RING;
+                }
+                else
+                {
+                    fprintf(stderr, "invalid storage [%s]\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPTION_BODY:
+                if(strcmp(optarg, "form") == 0)
+                {
+                    uploadBodyMode = UPLOAD_BODY_FORM;
+                }
+                else if(strcmp(optarg, "csv") == 0)
+                {
+                    uploadBodyMode = UPLOAD_BODY_CSV;
+                }
+                else if(strcmp(optarg, "binary") == 0)
+                {
+                    uploadBodyMode = UPLOAD_BODY_BINARY;
+                }
+                else
+                {
+                    fprintf(stderr, "invalid body [%s]\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPTION_COMPRESS:
+                if(strcmp(optarg, "none") == 0)
+                {
+                    uploadCompression = UPLOAD_COMPRESS_NONE;
+                }
+                else if(strcmp(optarg, "gzip") == 0)
+                {
+                    uploadCompression = UPLOAD_COMPRESS_GZIP;
+                }
+#ifdef HAVE_ZSTD
+                else if(strcmp(optarg, "zstd") == 0)
+                {
+                    uploadCompression = UPLOAD_COMPRESS_ZSTD;
+                }
+#endif
+                else
+                {
+                    fprintf(stderr, "invalid compress [%s]\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPTION_LOG_LEVEL:
+                if(strcmp(optarg, "error") == 0)
+                {
+                    logLevel = LOG_ERROR;
+                }
+                else if(strcmp(optarg, "warning") == 0)
+                {
+                    logLevel = LOG_WARNING;
+                }
+                else if(strcmp(optarg, "info") == 0)
+                {
+                    logLevel = LOG_INFO;
+                }
+                else if(strcmp(optarg, "debug") == 0)
+                {
+                    logLevel = LOG_DEBUG;
+                }
+                else
+                {
+                    fprintf(stderr, "invalid log level [%s]\n", optarg);
+                    return 1;
+                }
+                break;
+            case OPTION_LOG_FILE:
+                snprintf(logPath, sizeof(logPath), "%s", optarg);
+                break;
+            case OPTION_CONFIG:
+                snprintf(configPath, sizeof(configPath), "%s", optarg);
+                break;
+            case OPTION_TO_CSV:
+                crc32cInit();
+                return fileConvertToCsv(optarg, stdout) < 0 ? 1 : 0;
+            // those that can be changed while running, see settingSet()
+            case OPTION_BATCH_BYTES:
+            case OPTION_BATCH_RECORDS:
+            case OPTION_BACKOFF_BASE:
+            case OPTION_BACKOFF_MAX:
+            case OPTION_BREAKER_FAILURES:
+            case OPTION_SEGMENT_BYTES:
+            case OPTION_SEGMENT_MS:
+            case OPTION_RETAIN_SEGMENTS:
+            case OPTION_MAX_EVENTS:
+            case OPTION_MAX_DELAY:
+                settingSet(longOptions[optionIndex].name, number, false);
+                break;
+            case OPTION_CONNECT_TIMEOUT:
+                uploadConnectTimeoutMs = number;
+                break;
+            case OPTION_TIMEOUT:
+                uploadTimeoutMs = number;
+                break;
+            case OPTION_STAGING_FLUSH_MS:
+                stagingFlushMs = number;
+                break;
+            case OPTION_STAGING_FLUSH_EVENTS:
+                stagingFlushEvents = number;
+                break;
+            case OPTION_CACHE_RECORDS:
+                cacheRecords = number;
+                break;
+            case OPTION_COMPRESS_MIN_BYTES:
+                uploadCompressMinBytes = number;
+                break;
+            case OPTION_LOG_MAX_BYTES:
+                logMaxBytes = number;
+                break;
+            case OPTION_LOG_RATE:
+                logRate = number;
+                break;
+            case OPTION_RING_BYTES:
+                ringBytes = number > (long long) sizeof(struct countRecord) ? number : (long long) sizeof(struct countRecord);
+                break;
+            // channels to count, each -c adds one
+            case 'd':
+                snprintf(countDirectory, sizeof(countDirectory), "%s", optarg);
+                snprintf(segmentDirectory, sizeof(segmentDirectory), "%s/%s", countDirectory, SEGMENT_DIRECTORY);
+                break;
+            case 'C':
+                if(commitPolicyParse(optarg) < 0)
+                {
+                    fprintf(stderr, "invalid commit policy [%s]\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B':
+                benchmark = true;
+                break;
+            case 'g':
+                snprintf(gpioChipPath, sizeof(gpioChipPath), "%s", optarg);
+                break;
+            case 'c':
+                if(channelCount == CHANNEL_MAX || channelParse(optarg, &channels[channelCount]) < 0)
+                {
+                    fprintf(stderr, "invalid channel [%s]\n", optarg);
+                    return 1;
+                }
+                channelCount++;
+                recordChannelId = true;
+                break;
+            default:
+                return 1;
         }
     }
-    else {
-        printf("swap file already exists\n");
-    }
-
-    char * macAddress = fileGetMacAddress();
-    char * csv = fileGetSwapFileContents();
 
-    int requestPostCsvSuccess = requestPostCsv(macAddress, csv);
+    if(benchmark)
+    {
+        benchmarkUrlEncode();
+        benchmarkCompression();
+        benchmarkCommitPolicies();
+        benchmarkWriteAmplification();
+        benchmarkLoneHit();
+        return 0;
+    }
 
-    free(macAddress);
-    free(csv);
+    if(argc - optind < 1)
+    {
+        printf("signalCount: usage: signalCounter [-d dir] [-C write|sync|events:N|ms:T] [--format csv|binary|compressed] [--batch-bytes N] [--batch-records N] [--max-events N] [--max-delay-ms T] [--connect-timeout-ms N] [--timeout-ms N] [--backoff-base-ms N] [--backoff-max-ms N] [--breaker-failures N] [--segment-bytes N] [--segment-ms N] [--retain-segments N] [--storage segments|ring] [--body form|csv|binary] [--compress none|gzip|zstd] [--compress-min-bytes N] [--ring-bytes N] [--staging-flush-ms T] [--staging-flush-events K] [--cache-records N] [--log-level error|warning|info|debug] [--log-file path] [--config path] [--log-max-bytes N] [--log-rate N] [-g gpiochip] [-c id:pin[:rising|falling[:trigger_interval_ms]]]... [endpoint] (trigger_interval_ms)\n");
+        printf("       signalCounter [-d dir] -B\n");
+        printf("       signalCounter --to-csv file\n");
+        return 1;
+    }
 
-    // submit the contents of the file
-    if(requestPostCsvSuccess < 0) {
-        //submit failed, @todo log
-        isProcessingCountFile = false;
-        return;
+    // from here on, logging never blocks the thread doing it
+    if(logStart() < 0)
+    {
+        return 1;
     }
 
-    // successfully recorded, delete the swap file
-    if(remove(PATH_SIGNAL_COUNT_SWAP) < 0) {
-        printf("failed to delete swap\n");
-        //@todo record this properly
+    // settings in the config file go over those on the command line
+    if(configPath[0] != 0 && configLoad() < 0)
+    {
+        return 1;
     }
 
-    isProcessingCountFile = false;
-    printf("processCountFile ended\n");
-    return;
-}
+    // store endpoint
+    strcpy(endPointUrl, argv[optind]);
+    LOG(LOG_INFO, "Using [%s] as endpoint URL", endPointUrl);
 
-/**
- * get the current timestamp in milliseconds
- */
-unsigned long long getCurrentMilliseconds(void)
-{
-    struct timeval tv;
+    // store trigger interval, if we have one
+    if(argc - optind == 2)
+    {
+        if (intervalParse(argv[optind + 1], &triggerIntervalUs) < 0)
+        {
+            LOG(LOG_ERROR, "invalid trigger interval [%s]", argv[optind + 1]);
+            return 1;
+        }
+    }
 
-    gettimeofday(&tv, NULL);
+    LOG(LOG_INFO, "Using [%lldus] for trigger interval", triggerIntervalUs);
 
-    return (unsigned long long)(tv.tv_sec) * 1000 + (unsigned long long)(tv.tv_usec) / 1000;
-}
+    // no channels given, count the default input pin
+    if(channelCount == 0)
+    {
+        channels[0].id = 0;
+        channels[0].pin = gpioChipPath[0] != 0 ? PIN_INPUT_LINE : PIN_INPUT;
+        channels[0].edge = INT_EDGE_RISING;
+        channels[0].triggerIntervalUs = -1;
+        channelCount = 1;
+    }
 
-/**
- * the interrupt to fire when the input pin is pulled up to 3v
- */
-void signalIsr(void)
-{
-    unsigned long long interruptTimeMs = getCurrentMilliseconds();
+    for(c = 0; c < channelCount; c++)
+    {
+        if(channels[c].triggerIntervalUs < 0)
+        {
+            channels[c].triggerIntervalUs = triggerIntervalUs;
+        }
 
-    // determine whether this is rising edge or falling edge
-    if(digitalRead(PIN_INPUT) == 1) {
-        // rising edge
-        interruptTimeMsRising = interruptTimeMs;
-        return;
+        LOG(LOG_INFO, "Using channel [%d] on pin [%d], active %s, trigger interval [%lldus]",
+            channels[c].id,
+            channels[c].pin,
+            channels[c].edge == INT_EDGE_FALLING ? "low" : "high",
+            channels[c].triggerIntervalUs);
     }
 
-    // Was there a preceding rising edge detected?
-    if(interruptTimeMsRising == 0) {
-        // No rising value, ignore
-        return;
+    // pick up segments left by the last run. They are sealed as they are, with a torn tail cut off the newest
+    if(segmentManifestLoad() < 0)
+    {
+        return 1;
     }
 
-    // else, falling edge
-    unsigned long long intervalTimeMs = interruptTimeMs - interruptTimeMsRising;
-
-    // reset, ready for next event
-    interruptTimeMsRising = 0;
+    // everything allocated from here on comes from the pool where it can
+    if(memPoolInit() < 0)
+    {
+        LOG(LOG_ERROR, "Unable to allocate the memory pool");
+        return 1;
+    }
 
-    printf("\n\nnew signal - interval was %llu\n", intervalTimeMs);
+    if(cacheRecords > 0)
+    {
+        if((cacheEntries = memCalloc(cacheRecords, sizeof(* cacheEntries))) == NULL)
+        {
+            LOG(LOG_ERROR, "Unable to allocate the cache");
+            return 1;
+        }
 
-    if(intervalTimeMs < triggerInterval) {
-        printf("ignoring, signal time was not long enough\n");
-        return;
+        cacheSize = cacheRecords;
     }
 
-    // record the signal count to file
-    fileRecordSignalCount(interruptTimeMs);
+    if(storageMode == STORAGE_RING)
+    {
+        snprintf(ringPath, sizeof(ringPath), "%s/%s", countDirectory, RING_FILE_NAME);
+
+        if(ringOpen(ringPath) < 0)
+        {
+            return 1;
+        }
 
-    // blink the LED to show we recorded the signal
-    //piThreadCreate(ledSignalCounted);
-    ledBlink(50);
+        if(segmentManifestCount > 0)
+        {
+            LOG(LOG_INFO, "uploading %d segment(s) before the ring", segmentManifestCount);
+        }
+    }
 
-    // attempt to submit the count file
-    // disable - threads become unresponsive after a while. Rely on main loop call to processCountFile();
-    //processCountFile();
-}
+    // each device retries on its own schedule
+    srandom(getMonotonicMicroseconds() ^ getCurrentMilliseconds() ^ getpid());
 
-/**
- * init and run the application
- */
-int main(int argc, char *argv[])
-{
-    if(argc < 2)
+    // curl is set up once, and its handle kept for every upload. Its allocations come from the memory pool
+    if (curl_global_init_mem(CURL_GLOBAL_ALL, memAlloc, memFree, memRealloc, memStrdup, memCalloc) != 0 || uploadContextInit(&uploadContext) < 0)
     {
-        printf("signalCount: usage: signalCounter [endpoint] (trigger_interval_ms)\n");
+        LOG(LOG_ERROR, "Unable to setup curl");
         return 1;
     }
 
-    // store endpoint
-    strcpy(endPointUrl, argv[1]);
-    printf("Using [%s] as endpoint URL\n", endPointUrl);
-
-    // store trigger interval, if we have one
-    if(argc == 3)
+    // before any thread starts, so they all leave the signals to the event loop
+    if(eventLoopInit(&eventLoop, &uploadContext) < 0)
     {
-        char* p; // will be set to the "first invalid character" set by strtol
-        errno = 0;
-        triggerInterval = strtol(argv[2], &p, 10);
-        if (*p != '\0' || errno != 0)
-        {
-            fprintf(stderr, "invalid trigger interval [%s]\n", argv[2]);
-            return 1;
-        }
+        return 1;
     }
 
-    printf("Using [%d] for trigger interval\n", triggerInterval);
+    // start the writer thread before the ISR, so nothing queued is left waiting
+    sem_init(&signalRingSemaphore, 0, 0);
+    sem_init(&signalWriterStoppedSemaphore, 0, 0);
+
+    if(piThreadCreate(signalWriter) != 0)
+    {
+        LOG(LOG_ERROR, "Unable to start writer thread");
+        return 1;
+    }
 
     // init the wiringPi library
     if (wiringPiSetup () < 0)
     {
-        fprintf(stderr, "Unable to setup wiringPi: %s\n", strerror (errno));
+        LOG(LOG_ERROR, "Unable to setup wiringPi: %s", strerror (errno));
         return 1 ;
     }
 
-    // set up an interrupt on our input pin
-    if (wiringPiISR(PIN_INPUT, INT_EDGE_BOTH, &signalIsr) < 0)
+    if (gpioChipPath[0] != 0)
     {
-        fprintf(stderr, "Unable to setup ISR: %s\n", strerror (errno));
-        return 1 ;
+        // capture from the GPIO character device - the line request sets up bias and edge detection
+        LOG(LOG_INFO, "Using [%s] for capture", gpioChipPath);
+
+        if (gpioRequestLines(gpioChipPath) < 0 || piThreadCreate(gpioReader) != 0)
+        {
+            LOG(LOG_ERROR, "Unable to setup GPIO capture");
+            return 1;
+        }
+    }
+    else
+    {
+        // set up an interrupt on each input pin
+        for(c = 0; c < channelCount; c++)
+        {
+            if (wiringPiISR(channels[c].pin, INT_EDGE_BOTH, channelIsrs[c]) < 0)
+            {
+                LOG(LOG_ERROR, "Unable to setup ISR on pin %d: %s", channels[c].pin, strerror (errno));
+                return 1 ;
+            }
+        }
+
+        for(c = 0; c < channelCount; c++)
+        {
+            pinMode(channels[c].pin, INPUT);
+
+            // pull the internal logic gate to the idle level - we don't want it floating around
+            pullUpDnControl(channels[c].pin, channels[c].edge == INT_EDGE_FALLING ? PUD_UP : PUD_DOWN);
+        }
     }
 
     // configure the output pin for output. Output output output
     pinMode(PIN_OUTPUT, OUTPUT);
 
-    pinMode(PIN_INPUT, INPUT);
-
-    // pull the internal logic gate down to 0v - we don't want it floating around
-    pullUpDnControl(PIN_INPUT, PUD_DOWN);
-
     // blink 3 times - we're ready to go
     ledBlink(300);
     delay(300);
@@ -427,17 +6889,21 @@ int main(int argc, char *argv[])
     ledBlink(300);
 
     // send a test signal count with the current timestamp
-    fileRecordSignalCount(getCurrentMilliseconds());
-
-    printf("signalCount started\n");
+    fileRecordSignalCount(getCurrentMicroseconds(), 0, channels[0].id);
 
-    for(;;) {
-        delay(1000);
+    LOG(LOG_INFO, "signalCount started");
 
-        // this thread will submit any count files that have not been sent
-        printf("about to run cleanup thread\n");
-        processCountFile();
+    // submit any count files that have not been sent, and everything recorded from now on, until told to stop
+    if(eventLoopRun(&eventLoop, &uploadContext) < 0)
+    {
+        return 1;
     }
 
+    shutdownCommit(&uploadContext);
+
+    eventLoopCleanup(&eventLoop);
+    uploadContextCleanup(&uploadContext);
+    curl_global_cleanup();
+
     return 0;
 }